@@ -0,0 +1,217 @@
+//
+//  batch.c
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "batch.h"
+
+// Queued items per worker, enough to keep workers busy while the producer reads ahead
+#define QUEUE_ITEMS_PER_WORKER  4
+
+enum {
+    kWorkerIdle = 0,
+    kWorkerBusy,
+    kWorkerRetired      // given up on while busy; its thread never touches the batch again
+};
+
+typedef struct _BatchWorker {
+    Batch *         batch;
+    int             index;
+    pthread_t       thread;
+    volatile int    state;
+} BatchWorker;
+
+struct _Batch {
+    BatchFunction       function;
+    void *              context;
+    BatchWorker **      workers;            // by index; retired workers are left allocated
+    int                 workerCount;
+    int                 maxWorkers;
+    
+    pthread_mutex_t     lock;
+    pthread_cond_t      itemsAvailable;     // signalled when the queue gains an item or stops
+    pthread_cond_t      spaceAvailable;     // signalled when an item is taken or finishes
+    void **             queue;              // ring buffer
+    int                 capacity;
+    int                 head;
+    int                 queued;
+    int                 running;
+    int                 stopping;
+};
+
+static void *batch_worker(void *argument)
+{
+    BatchWorker *worker = (BatchWorker *) argument;
+    Batch *batch = worker->batch;
+    
+    pthread_mutex_lock(&batch->lock);
+    for (;;) {
+        while (batch->queued == 0 && !batch->stopping) {
+            pthread_cond_wait(&batch->itemsAvailable, &batch->lock);
+        }
+        if (batch->queued == 0) {
+            break;
+        }
+        
+        void *item = batch->queue[batch->head];
+        batch->head = (batch->head + 1) % batch->capacity;
+        batch->queued--;
+        batch->running++;
+        worker->state = kWorkerBusy;
+        pthread_cond_signal(&batch->spaceAvailable);
+        pthread_mutex_unlock(&batch->lock);
+        
+        batch->function(item, worker->index, batch->context);
+        
+        // Either this or batch_retire_worker() wins; a retired worker's batch may be gone
+        if (!__sync_bool_compare_and_swap(&worker->state, kWorkerBusy, kWorkerIdle)) {
+            return NULL;
+        }
+        pthread_mutex_lock(&batch->lock);
+        batch->running--;
+        pthread_cond_broadcast(&batch->spaceAvailable);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+// Called with the lock held, or before any worker runs
+static int add_worker(Batch *batch)
+{
+    if (batch->workerCount == batch->maxWorkers) {
+        return -1;
+    }
+    BatchWorker *worker = calloc(1, sizeof(BatchWorker));
+    worker->batch = batch;
+    worker->index = batch->workerCount;
+    if (pthread_create(&worker->thread, NULL, batch_worker, worker) != 0) {
+        free(worker);
+        return -1;
+    }
+    batch->workers[batch->workerCount++] = worker;
+    return 0;
+}
+
+Batch *batch_create (int threads, BatchFunction function, void *context)
+{
+    Batch *batch = calloc(1, sizeof(Batch));
+    if (!batch) {
+        return NULL;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    batch->function = function;
+    batch->context = context;
+    batch->maxWorkers = threads * 2;
+    batch->workers = calloc(batch->maxWorkers, sizeof(BatchWorker *));
+    batch->capacity = threads * QUEUE_ITEMS_PER_WORKER;
+    batch->queue = malloc(batch->capacity * sizeof(void *));
+    
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->itemsAvailable, NULL);
+    pthread_cond_init(&batch->spaceAvailable, NULL);
+    
+    pthread_mutex_lock(&batch->lock);
+    for (int i = 0; i < threads; i++) {
+        add_worker(batch);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    
+    if (batch->workerCount == 0) {
+        batch_free(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+int batch_max_workers (const Batch *batch)
+{
+    return batch->maxWorkers;
+}
+
+void batch_submit (Batch *batch, void *item)
+{
+    pthread_mutex_lock(&batch->lock);
+    while (batch->queued == batch->capacity) {
+        pthread_cond_wait(&batch->spaceAvailable, &batch->lock);
+    }
+    batch->queue[(batch->head + batch->queued) % batch->capacity] = item;
+    batch->queued++;
+    pthread_cond_signal(&batch->itemsAvailable);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+void batch_wait (Batch *batch)
+{
+    pthread_mutex_lock(&batch->lock);
+    while (batch->queued > 0 || batch->running > 0) {
+        pthread_cond_wait(&batch->spaceAvailable, &batch->lock);
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
+
+int batch_retire_worker (Batch *batch, int index)
+{
+    pthread_mutex_lock(&batch->lock);
+    BatchWorker *worker = (index >= 0 && index < batch->workerCount) ? batch->workers[index] : NULL;
+    int retired = worker && __sync_bool_compare_and_swap(&worker->state, kWorkerBusy, kWorkerRetired);
+    if (retired) {
+        pthread_detach(worker->thread);
+        batch->running--;
+        if (add_worker(batch) != 0) {
+            fprintf(stderr, "No replacement for stalled worker %d, continuing with fewer\n", index);
+        }
+        pthread_cond_broadcast(&batch->spaceAvailable);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return retired;
+}
+
+void batch_free (Batch *batch)
+{
+    if (!batch) {
+        return;
+    }
+    
+    pthread_mutex_lock(&batch->lock);
+    batch->stopping = 1;
+    pthread_cond_broadcast(&batch->itemsAvailable);
+    pthread_mutex_unlock(&batch->lock);
+    
+    // Workers drain the queue before they exit. Retired workers are detached and may
+    // still be blocked, so they and their records are left alone.
+    for (int i = 0; i < batch->workerCount; i++) {
+        BatchWorker *worker = batch->workers[i];
+        if (worker->state != kWorkerRetired) {
+            pthread_join(worker->thread, NULL);
+            free(worker);
+        }
+    }
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->itemsAvailable);
+    pthread_cond_destroy(&batch->spaceAvailable);
+    free(batch->workers);
+    free(batch->queue);
+    free(batch);
+}
@@ -0,0 +1,46 @@
+//
+//  batch.h
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QTVRFIX_BATCH_H
+#define QTVRFIX_BATCH_H
+
+// Called on a worker thread for each submitted item. worker is the index of the
+// worker, below batch_max_workers().
+typedef void (*BatchFunction)(void *item, int worker, void *context);
+
+// A fixed pool of worker threads fed through a bounded queue
+typedef struct _Batch Batch;
+
+Batch *batch_create (int threads, BatchFunction function, void *context);
+// Workers that replace retired ones get new indexes, up to twice the thread count
+int batch_max_workers (const Batch *batch);
+// Blocks while the queue is full
+void batch_submit (Batch *batch, void *item);
+// Returns once every submitted item has finished, not counting retired workers' items
+void batch_wait (Batch *batch);
+// Gives up on a worker stuck in the function and starts a replacement. The stuck call
+// keeps its item and must not touch shared state once it returns. Returns 0 if the
+// worker had already finished.
+int batch_retire_worker (Batch *batch, int worker);
+// Waits, then stops the workers
+void batch_free (Batch *batch);
+
+#endif
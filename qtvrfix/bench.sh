@@ -0,0 +1,186 @@
+#!/bin/bash
+#
+#  bench.sh
+#  qtvrfix
+#
+#  Benchmarks for the repair pass. The movies are fixed in place, so every run starts from
+#  a fresh copy of the corpus.
+#
+#    bench.sh corpus DIR [COUNT [SAMPLES [PADDING]]]
+#        writes COUNT synthetic pano movies (default 100) of SAMPLES samples (default 16),
+#        each followed by PADDING bytes standing in for image media (default 262144), to DIR
+#    bench.sh map-policy DIR QTVRFIX [BASELINE]
+#        fixes DIR with each --map-policy, from a cold page cache when run as root, and
+#        prints the median wall time and the mean page faults; BASELINE is timed too
+#    bench.sh parser DIR QTVRFIX...
+#        repairs a copy of DIR once, then runs each binary over it from a warm page cache and
+#        prints the median wall and user CPU times, and the time spent fixing the movies as
+#        reported by --stats where the binary has it; nothing is left to write, so the
+#        times are those of reading and checking the movies
+#
+#  RUNS sets the number of runs of each setting (default 5).
+#
+
+RUNS=${RUNS:-5}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/qtvrfix-bench.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# Writes big-endian 16 and 32-bit numbers
+be16()
+{
+    local out="" b
+    for shift in 8 0; do
+        b=$(( ($1 >> shift) & 255 ))
+        out="$out\\$((b >> 6))$((b >> 3 & 7))$((b & 7))"
+    done
+    printf "$out"
+}
+
+be32()
+{
+    be16 $(( ($1 >> 16) & 65535 ))
+    be16 $(( $1 & 65535 ))
+}
+
+box()
+{
+    be32 $(( 8 + $2 ))
+    printf '%s' "$1"
+}
+
+zeros()
+{
+    head -c "$1" /dev/zero
+}
+
+# ftyp, then mdat holding the samples, then moov with one 'pano' track. Every sample needs
+# the built-in repair: hotSpotSizeX is 0 and the hot spot frame counts are 1.
+make_movie()
+{
+    local path=$1 samples=$2 padding=$3
+    local sampleSize=136 stride=$(( 136 + padding ))
+    local stszSize=$(( 20 + 4 * samples )) stcoSize=$(( 16 + 4 * samples ))
+    local stblSize=$(( 8 + 28 + stszSize + stcoSize ))
+    local minfSize=$(( 8 + stblSize ))
+    local mdiaSize=$(( 8 + 32 + 33 + minfSize ))
+    local trakSize=$(( 8 + 92 + mdiaSize ))
+    {
+        box ftyp 12; printf 'qt  '; zeros 4; printf 'qt  '
+        box mdat $(( samples * stride ))
+        for (( i = 0; i < samples; i++ )); do
+            zeros 12
+            be32 124; printf 'sean'; be32 1; be16 0; be16 1; be32 0
+            be32 104; printf 'pdat'; be32 1; be16 0; be16 0; be32 0
+            be16 2; be16 0; be32 1; be32 0
+            for (( f = 0; f < 9; f++ )); do be32 $(( 0x43b40000 )); done
+            be32 $(( 2048 + i )); be32 1024; be16 1; be16 1
+            be32 0; be32 0; be16 1; be16 1; be32 0; be32 0; be32 0
+            zeros "$padding"
+        done
+        box moov $(( 108 + trakSize ))
+        box mvhd 100; zeros 100
+        box trak $(( trakSize - 8 ))
+        box tkhd 84; zeros 84
+        box mdia $(( mdiaSize - 8 ))
+        box mdhd 24; zeros 24
+        box hdlr 25; zeros 8; printf 'pano'; zeros 13
+        box minf $(( minfSize - 8 ))
+        box stbl $(( stblSize - 8 ))
+        box stsc 20; zeros 4; be32 1; be32 1; be32 1; be32 1
+        box stsz $(( stszSize - 8 )); zeros 4; be32 0; be32 "$samples"
+        for (( i = 0; i < samples; i++ )); do be32 "$sampleSize"; done
+        box stco $(( stcoSize - 8 )); zeros 4; be32 "$samples"
+        for (( i = 0; i < samples; i++ )); do be32 $(( 28 + i * stride )); done
+    } > "$path"
+}
+
+make_corpus()
+{
+    local dir=$1 count=${2:-100} samples=${3:-16} padding=${4:-262144}
+    mkdir -p "$dir" || exit 1
+    make_movie "$dir/pano0001.mov" "$samples" "$padding"
+    for (( n = 2; n <= count; n++ )); do
+        cp "$dir/pano0001.mov" "$(printf '%s/pano%04d.mov' "$dir" "$n")"
+    done
+}
+
+# Copies the corpus for one run and, as root, empties the page cache
+fresh_copy()
+{
+    rm -rf "$WORK/run"
+    cp -R "$1" "$WORK/run"
+    if [ "$(id -u)" -eq 0 ] && [ -n "$COLD" ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches 2> /dev/null || purge 2> /dev/null
+    fi
+}
+
+# Runs a command RUNS times on fresh copies; prints the median wall and user CPU times in
+# seconds, the median of the per-file times reported by --stats summed over the corpus in
+# milliseconds, and the mean minor and major faults (0 for binaries without --stats)
+measure()
+{
+    local corpus=$1
+    shift
+    local times=() userTimes=() fixTimes=() minor=0 major=0 wall user
+    TIMEFORMAT='%R %U'
+    for (( run = 0; run < RUNS; run++ )); do
+        fresh_copy "$corpus"
+        read -r wall user < <( { time "$@" "$WORK"/run/*.mov > "$WORK/stats.txt" 2> /dev/null; } 2>&1 )
+        times+=( "$wall" )
+        userTimes+=( "$user" )
+        fixTimes+=( $(sed -n 's|.*, \([0-9.]*\) ms$|\1|p' "$WORK/stats.txt" | awk '{ total += $1 } END { print total + 0 }') )
+        read -r runMinor runMajor < <(sed -n 's|.* \([0-9]*\) minor/\([0-9]*\) major faults.*|\1 \2|p' "$WORK/stats.txt" |
+                                      awk '{ minor += $1; major += $2 } END { print minor + 0, major + 0 }')
+        minor=$(( minor + runMinor ))
+        major=$(( major + runMajor ))
+    done
+    local median=$(printf '%s\n' "${times[@]}" | sort -n | sed -n "$(( (RUNS + 1) / 2 ))p")
+    local userMedian=$(printf '%s\n' "${userTimes[@]}" | sort -n | sed -n "$(( (RUNS + 1) / 2 ))p")
+    local fixMedian=$(printf '%s\n' "${fixTimes[@]}" | sort -n | sed -n "$(( (RUNS + 1) / 2 ))p")
+    echo "$median $userMedian $fixMedian $(( minor / RUNS )) $(( major / RUNS ))"
+}
+
+map_policy()
+{
+    local corpus=$1 qtvrfix=$2 baseline=$3
+    COLD=1
+    [ "$(id -u)" -eq 0 ] || echo "Not root, so the page cache isn't emptied between runs"
+    printf '%-26s %10s %14s %14s\n' "policy" "wall (s)" "minor faults" "major faults"
+    if [ -n "$baseline" ]; then
+        read -r wall user fix minor major < <(measure "$corpus" "$baseline")
+        printf '%-26s %10s %14s %14s\n' "baseline" "$wall" "-" "-"
+    fi
+    for policy in default random willneed populate prefetch random,prefetch random,populate,prefetch; do
+        read -r wall user fix minor major < <(measure "$corpus" "$qtvrfix" --io mmap --map-policy "$policy" --stats)
+        printf '%-26s %10s %14s %14s\n' "$policy" "$wall" "$minor" "$major"
+    done
+}
+
+parser()
+{
+    local corpus=$1
+    shift
+    fresh_copy "$corpus"
+    "$1" "$WORK"/run/*.mov > /dev/null 2>&1
+    rm -rf "$WORK/repaired"
+    mv "$WORK/run" "$WORK/repaired"
+    
+    printf '%-40s %10s %10s %10s\n' "binary" "wall (s)" "user (s)" "fix (ms)"
+    for qtvrfix in "$@"; do
+        if "$qtvrfix" --help 2>&1 | grep -q -e --stats; then
+            read -r wall user fix minor major < <(measure "$WORK/repaired" "$qtvrfix" --stats)
+        else
+            read -r wall user fix minor major < <(measure "$WORK/repaired" "$qtvrfix")
+            fix=-
+        fi
+        printf '%-40s %10s %10s %10s\n' "$qtvrfix" "$wall" "$user" "$fix"
+    done
+}
+
+case "$1" in
+    corpus)     shift; make_corpus "$@" ;;
+    map-policy) shift; map_policy "$@" ;;
+    parser)     shift; parser "$@" ;;
+    *)          sed -n '9,22s/^#  \{0,1\}//p' "$0"; exit 1 ;;
+esac
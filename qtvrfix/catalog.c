@@ -0,0 +1,222 @@
+//
+//  catalog.c
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+
+#define ENTRY_HEADER_SIZE   52
+#define RECORD_SIZE         (8 + QTVRFIX_PDAT_SIZE)
+// Entries up to this size, a path and a few dozen samples, are built on the stack
+#define MAX_STACK_ENTRY     8192
+
+static const char cCatalogMagic[8] = { 'Q', 'T', 'V', 'R', 'C', 'A', 'T', CATALOG_VERSION };
+
+// Record locks only keep out other processes, so the threads of this one take turns here
+static pthread_mutex_t sAppendLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint8_t *put_u16(uint8_t *out, uint16_t value)
+{
+    out[0] = value >> 8;
+    out[1] = value;
+    return out + 2;
+}
+
+static uint8_t *put_u32(uint8_t *out, uint32_t value)
+{
+    out = put_u16(out, value >> 16);
+    return put_u16(out, value);
+}
+
+static uint8_t *put_u64(uint8_t *out, uint64_t value)
+{
+    out = put_u32(out, value >> 32);
+    return put_u32(out, value);
+}
+
+// Locks or unlocks the whole catalog, waiting for other processes. Over NFS this also
+// makes the client see the current end of the file, which O_APPEND alone doesn't.
+static int lock_catalog(int fd, short type)
+{
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    int result;
+    while ((result = fcntl(fd, F_SETLKW, &lock)) == -1 && errno == EINTR) {
+    }
+    return result;
+}
+
+// Creates the catalog with its header. The header is written to a private file that is
+// then linked into place, so nobody can append to a catalog that doesn't start with it
+// yet, and of several processes starting at once only one creates it. Where hard links
+// aren't supported the catalog is created empty and catalog_open() adds the header.
+// Returns 0 once the catalog exists.
+static int create_catalog(const char *path)
+{
+    size_t tempSize = strlen(path) + 32;
+    char *temp = malloc(tempSize);
+    if (!temp) {
+        return -1;
+    }
+    snprintf(temp, tempSize, "%s.%ld.tmp", path, (long) getpid());
+    
+    int result = -1;
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd != -1) {
+        if (write(fd, cCatalogMagic, sizeof(cCatalogMagic)) == sizeof(cCatalogMagic)) {
+            result = (link(temp, path) == 0 || errno == EEXIST) ? 0 : 1;
+        }
+        close(fd);
+        unlink(temp);
+    }
+    free(temp);
+    
+    if (result == 1) {
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd != -1) {
+            close(fd);
+        }
+        result = (fd != -1 || errno == EEXIST) ? 0 : -1;
+    }
+    return result;
+}
+
+// Adds the header to an empty catalog, or checks the one it starts with
+static int check_header(int fd, const char *path)
+{
+    struct stat fs;
+    char header[sizeof(cCatalogMagic)];
+    
+    if (fstat(fd, &fs) != 0) {
+        fprintf(stderr, "Could not read catalog %s: %d\n", path, errno);
+        return -1;
+    }
+    if (fs.st_size == 0) {
+        if (write(fd, cCatalogMagic, sizeof(cCatalogMagic)) != sizeof(cCatalogMagic)) {
+            fprintf(stderr, "Could not write catalog %s: %d\n", path, errno);
+            return -1;
+        }
+        return 0;
+    }
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, cCatalogMagic, sizeof(header) - 1) != 0) {
+        fprintf(stderr, "%s is not a catalog\n", path);
+        return -1;
+    }
+    if (header[sizeof(header) - 1] != CATALOG_VERSION) {
+        fprintf(stderr, "Catalog %s has version %d, expected %d\n", path, header[sizeof(header) - 1], CATALOG_VERSION);
+        return -1;
+    }
+    return 0;
+}
+
+int catalog_open (const char *path)
+{
+    int fd = open(path, O_RDWR | O_APPEND);
+    if (fd == -1 && errno == ENOENT && create_catalog(path) == 0) {
+        fd = open(path, O_RDWR | O_APPEND);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "Could not open catalog %s: %d\n", path, errno);
+        return -1;
+    }
+    
+    // Without a lock manager the header is still checked, only not under the lock
+    int locked = (lock_catalog(fd, F_WRLCK) == 0);
+    int result = check_header(fd, path);
+    if (locked) {
+        lock_catalog(fd, F_UNLCK);
+    }
+    if (result != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int catalog_append (int fd, const char *moviePath, const QTVRFixStats *stats)
+{
+    size_t pathLength = strlen(moviePath);
+    if (pathLength > UINT16_MAX) {
+        pathLength = UINT16_MAX;
+    }
+    size_t entrySize = ENTRY_HEADER_SIZE + pathLength + (size_t) stats->panoRecordCount * RECORD_SIZE;
+    uint8_t stackEntry[MAX_STACK_ENTRY];
+    uint8_t *entry = (entrySize <= MAX_STACK_ENTRY) ? stackEntry : malloc(entrySize);
+    if (!entry || entrySize > UINT32_MAX) {
+        if (entry != stackEntry) {
+            free(entry);
+        }
+        return -1;
+    }
+    
+    uint8_t *out = entry;
+    out = put_u32(out, (uint32_t) entrySize);
+    out = put_u32(out, stats->panoRecordCount);
+    out = put_u64(out, stats->movieOffset);
+    out = put_u64(out, stats->fileSize);
+    out = put_u64(out, (int64_t) stats->modifiedTime);
+    *out++ = stats->hasDigest ? 1 : 0;
+    *out++ = 0;
+    out = put_u16(out, (uint16_t) pathLength);
+    if (stats->hasDigest) {
+        memcpy(out, stats->digest, sizeof(stats->digest));
+    } else {
+        memset(out, 0, sizeof(stats->digest));
+    }
+    out += sizeof(stats->digest);
+    memcpy(out, moviePath, pathLength);
+    out += pathLength;
+    
+    for (uint32_t i = 0; i < stats->panoRecordCount; i++) {
+        const QTVRFixPanoRecord *record = &stats->panoRecords[i];
+        out = put_u32(out, record->track);
+        out = put_u32(out, record->sample);
+        memcpy(out, record->pdat, QTVRFIX_PDAT_SIZE);
+        out += QTVRFIX_PDAT_SIZE;
+    }
+    
+    // O_APPEND places the whole entry at the end in one step on a local disk. Over NFS
+    // only the lock does, where the server has a lock manager.
+    pthread_mutex_lock(&sAppendLock);
+    int locked = (lock_catalog(fd, F_WRLCK) == 0);
+    ssize_t written = write(fd, entry, entrySize);
+    if (locked) {
+        lock_catalog(fd, F_UNLCK);
+    }
+    pthread_mutex_unlock(&sAppendLock);
+    if (entry != stackEntry) {
+        free(entry);
+    }
+    if (written != (ssize_t) entrySize) {
+        fprintf(stderr, "Error writing catalog entry for %s: %d\n", moviePath, errno);
+        return -1;
+    }
+    return 0;
+}
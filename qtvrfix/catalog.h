@@ -0,0 +1,51 @@
+//
+//  catalog.h
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef QTVRFIX_CATALOG_H
+#define QTVRFIX_CATALOG_H
+
+#include "qtvrfix.h"
+
+// Append-only binary catalog of the pano samples seen while fixing. The file starts with
+// the 8 bytes "QTVRCAT" and a version byte, then holds one entry per movie, each added
+// with a single write. All numbers are big-endian.
+//   u32 entry size, this field included    u32 record count
+//   u64 movie offset in its file           u64 movie size
+//   s64 file modification time             u8  flags (1: digest present)
+//   u8  reserved                           u16 path length
+//   u8  digest[16]                         path bytes, not terminated
+// followed by the records:
+//   u32 track                              u32 sample
+//   u8  pdat[84], laid out as QTVRPanoSampleAtom
+// The modification time identifies plain files only. An archive member's entry has the
+// archive's time when the member was repaired, which repairs of later members change.
+#define CATALOG_VERSION     1
+
+// Returns a descriptor for catalog_append(), or -1. Creates the catalog if it doesn't
+// exist, and refuses a file without the header or with another version.
+int catalog_open (const char *path);
+// Safe to call from several threads, or processes sharing the file. Each entry is written
+// under a record lock, so processes on several NFS clients can share one catalog when the
+// server has a lock manager.
+int catalog_append (int fd, const char *moviePath, const QTVRFixStats *stats);
+
+#endif
@@ -0,0 +1,504 @@
+//
+//  digest.c
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "digest.h"
+
+#define MAX_DIGEST_THREADS  16
+
+#pragma mark XXH64
+
+// XXH64, with four independent lanes per 32-byte stripe so the compiler can keep
+// them in flight together. Input is read as little-endian on every platform.
+static const uint64_t cPrime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t cPrime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t cPrime3 = 0x165667B19E3779F9ULL;
+static const uint64_t cPrime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t cPrime5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64le(const uint8_t *p)
+{
+    return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24) |
+           ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static inline uint32_t read32le(const uint8_t *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * cPrime2;
+    acc = rotl64(acc, 31);
+    return acc * cPrime1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t lane)
+{
+    acc ^= xxh64_round(0, lane);
+    return acc * cPrime1 + cPrime4;
+}
+
+static uint64_t xxh64(const uint8_t *data, size_t length, uint64_t seed)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = data + length;
+    uint64_t hash;
+    
+    if (length >= 32) {
+        uint64_t lanes[4] = { seed + cPrime1 + cPrime2, seed + cPrime2, seed, seed - cPrime1 };
+        const uint8_t *limit = end - 32;
+        do {
+            lanes[0] = xxh64_round(lanes[0], read64le(p));
+            lanes[1] = xxh64_round(lanes[1], read64le(p + 8));
+            lanes[2] = xxh64_round(lanes[2], read64le(p + 16));
+            lanes[3] = xxh64_round(lanes[3], read64le(p + 24));
+            p += 32;
+        } while (p <= limit);
+        
+        hash = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = xxh64_merge(hash, lanes[i]);
+        }
+    } else {
+        hash = seed + cPrime5;
+    }
+    
+    hash += (uint64_t) length;
+    for (; p + 8 <= end; p += 8) {
+        hash ^= xxh64_round(0, read64le(p));
+        hash = rotl64(hash, 27) * cPrime1 + cPrime4;
+    }
+    if (p + 4 <= end) {
+        hash ^= (uint64_t) read32le(p) * cPrime1;
+        hash = rotl64(hash, 23) * cPrime2 + cPrime3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash ^= (*p) * cPrime5;
+        hash = rotl64(hash, 11) * cPrime1;
+    }
+    
+    hash ^= hash >> 33;
+    hash *= cPrime2;
+    hash ^= hash >> 29;
+    hash *= cPrime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+
+#pragma mark Chunked Hashing
+
+typedef struct _DigestJob {
+    int                     fd;
+    off_t                   start;
+    off_t                   length;
+    const QTVRFixPatch *    masks;
+    uint32_t                maskCount;
+    uint64_t *              chunkHashes;
+    uint32_t                chunkCount;
+    volatile uint32_t       nextChunk;
+    volatile int            failed;
+    volatile const int *    cancel;
+} DigestJob;
+
+// Zeroes the parts of a chunk covered by patch ranges
+static void mask_chunk(const DigestJob *job, uint8_t *buffer, off_t chunkStart, size_t chunkLength)
+{
+    for (uint32_t i = 0; i < job->maskCount; i++) {
+        off_t maskStart = job->masks[i].offset;
+        off_t maskEnd = maskStart + job->masks[i].length;
+        if (maskEnd <= chunkStart || maskStart >= chunkStart + (off_t) chunkLength) {
+            continue;
+        }
+        off_t from = (maskStart > chunkStart) ? maskStart : chunkStart;
+        off_t to = (maskEnd < chunkStart + (off_t) chunkLength) ? maskEnd : chunkStart + (off_t) chunkLength;
+        memset(buffer + (from - chunkStart), 0, to - from);
+    }
+}
+
+static void hash_chunks(DigestJob *job, uint8_t *buffer)
+{
+    uint32_t chunk;
+    while (!job->failed && (chunk = __sync_fetch_and_add(&job->nextChunk, 1)) < job->chunkCount) {
+        if (job->cancel && *job->cancel) {
+            job->failed = 1;
+            break;
+        }
+        off_t chunkStart = (off_t) chunk * DIGEST_CHUNK_SIZE;
+        size_t chunkLength = (job->length - chunkStart < DIGEST_CHUNK_SIZE) ? (size_t)(job->length - chunkStart) : DIGEST_CHUNK_SIZE;
+        
+        size_t done = 0;
+        while (done < chunkLength) {
+            ssize_t count = pread(job->fd, buffer + done, chunkLength - done, job->start + chunkStart + done);
+            if (count <= 0) {
+                if (count < 0 && errno == EINTR && !(job->cancel && *job->cancel)) {
+                    continue;
+                }
+                job->failed = 1;
+                break;
+            }
+            done += count;
+        }
+        if (job->failed) {
+            break;
+        }
+        
+        mask_chunk(job, buffer, chunkStart, chunkLength);
+        job->chunkHashes[chunk] = xxh64(buffer, chunkLength, chunk);
+    }
+}
+
+// One helper thread and the chunk buffer it reads into
+typedef struct _DigestWorker {
+    DigestJob *             job;
+    uint8_t *               buffer;
+} DigestWorker;
+
+static void *digest_worker(void *context)
+{
+    DigestWorker *worker = (DigestWorker *) context;
+    hash_chunks(worker->job, worker->buffer);
+    return NULL;
+}
+
+static uint32_t digest_chunk_count(off_t length)
+{
+    return (uint32_t)((length + DIGEST_CHUNK_SIZE - 1) / DIGEST_CHUNK_SIZE);
+}
+
+static int digest_thread_count(off_t length, int threads)
+{
+    uint32_t chunkCount = digest_chunk_count(length);
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > MAX_DIGEST_THREADS) {
+        threads = MAX_DIGEST_THREADS;
+    }
+    if ((uint32_t) threads > chunkCount) {
+        threads = chunkCount ? chunkCount : 1;
+    }
+    return threads;
+}
+
+static size_t digest_buffer_size(off_t length)
+{
+    return (length < DIGEST_CHUNK_SIZE) ? (size_t) length : DIGEST_CHUNK_SIZE;
+}
+
+size_t digest_buffers_size (off_t length, int threads)
+{
+    return digest_thread_count(length, threads) * digest_buffer_size(length);
+}
+
+size_t digest_hashes_size (off_t length)
+{
+    // One more for the length, which is combined with them
+    return ((size_t) digest_chunk_count(length) + 1) * sizeof(uint64_t);
+}
+
+int digest_file (int fd, off_t start, off_t length, const QTVRFixPatch *masks, uint32_t maskCount, int threads, uint8_t *buffers,
+                 uint64_t *chunkHashes, volatile const int *cancel, uint8_t digest[DIGEST_SIZE])
+{
+    DigestJob job;
+    memset(&job, 0, sizeof(DigestJob));
+    job.fd = fd;
+    job.start = start;
+    job.length = length;
+    job.masks = masks;
+    job.maskCount = maskCount;
+    job.cancel = cancel;
+    job.chunkCount = digest_chunk_count(length);
+    threads = digest_thread_count(length, threads);
+    
+    uint8_t *ownBuffers = buffers ? NULL : malloc(digest_buffers_size(length, threads) + 1);
+    uint64_t *ownHashes = chunkHashes ? NULL : malloc(digest_hashes_size(length));
+    job.chunkHashes = chunkHashes ? chunkHashes : ownHashes;
+    buffers = buffers ? buffers : ownBuffers;
+    if (!buffers || !job.chunkHashes) {
+        free(ownBuffers);
+        free(ownHashes);
+        return -1;
+    }
+    
+    // The calling thread is one of the workers, and uses the first buffer
+    size_t bufferSize = digest_buffer_size(length);
+    pthread_t threadIds[MAX_DIGEST_THREADS];
+    DigestWorker workers[MAX_DIGEST_THREADS];
+    int started = 0;
+    for (int i = 1; i < threads; i++) {
+        workers[started].job = &job;
+        workers[started].buffer = buffers + i * bufferSize;
+        if (pthread_create(&threadIds[started], NULL, digest_worker, &workers[started]) == 0) {
+            started++;
+        }
+    }
+    hash_chunks(&job, buffers);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threadIds[i], NULL);
+    }
+    
+    if (!job.failed) {
+        // Combine the chunk hashes, in order, into two independent 64-bit halves. Each
+        // hash is rewritten as little-endian bytes where it is stored.
+        uint8_t *list = (uint8_t *) job.chunkHashes;
+        job.chunkHashes[job.chunkCount] = (uint64_t) length;
+        for (uint32_t i = 0; i <= job.chunkCount; i++) {
+            uint64_t hash = job.chunkHashes[i];
+            for (int b = 0; b < 8; b++) {
+                list[i * 8 + b] = (uint8_t)(hash >> (8 * b));
+            }
+        }
+        uint64_t halves[2] = { xxh64(list, job.chunkCount * 8 + 8, 0), xxh64(list, job.chunkCount * 8 + 8, cPrime5) };
+        for (int i = 0; i < DIGEST_SIZE; i++) {
+            digest[i] = (uint8_t)(halves[i / 8] >> (56 - 8 * (i % 8)));
+        }
+    }
+    
+    free(ownBuffers);
+    free(ownHashes);
+    return job.failed ? -1 : 0;
+}
+
+
+#pragma mark Digest Records
+
+static void write_escaped_path(FILE *file, const char *path)
+{
+    for (const char *c = path; *c; c++) {
+        switch (*c) {
+            case '\\': fputs("\\\\", file); break;
+            case '\t': fputs("\\t", file); break;
+            case '\n': fputs("\\n", file); break;
+            default:   fputc(*c, file); break;
+        }
+    }
+}
+
+static void unescape_path(char *path)
+{
+    char *out = path;
+    for (char *in = path; *in; in++) {
+        if (*in == '\\' && in[1]) {
+            in++;
+            *out++ = (*in == 't') ? '\t' : (*in == 'n') ? '\n' : *in;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+}
+
+static void format_digest(const uint8_t digest[DIGEST_SIZE], char hex[DIGEST_SIZE * 2 + 1])
+{
+    for (int i = 0; i < DIGEST_SIZE; i++) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+}
+
+// Record line: DIGEST <tab> SIZE <tab> PATCHES <tab> PATH [<tab> START [<tab> STATUS]], where
+// PATCHES is '-' or a comma-separated list of OFFSET+LENGTH:OLD>NEW with the bytes in hex.
+// START is where an archive member's data begins in PATH; patch offsets are relative to it.
+// STATUS is the result code when the movie was only partly repaired.
+void digest_write_record (FILE *file, const char *moviePath, const QTVRFixStats *stats, int result)
+{
+    char hex[DIGEST_SIZE * 2 + 1];
+    format_digest(stats->digest, hex);
+    fprintf(file, "%s\t%lld\t", hex, (long long) stats->fileSize);
+    
+    if (stats->patchCount == 0) {
+        fputc('-', file);
+    }
+    for (uint32_t i = 0; i < stats->patchCount; i++) {
+        const QTVRFixPatch *patch = &stats->patches[i];
+        fprintf(file, "%s%lld+%u:", i ? "," : "", (long long) patch->offset, patch->length);
+        for (int b = 0; b < patch->length; b++) {
+            fprintf(file, "%02x", patch->oldBytes[b]);
+        }
+        fputc('>', file);
+        for (int b = 0; b < patch->length; b++) {
+            fprintf(file, "%02x", patch->newBytes[b]);
+        }
+    }
+    fputc('\t', file);
+    write_escaped_path(file, moviePath);
+    if (stats->movieOffset || result != kQTVRFixNoErr) {
+        fprintf(file, "\t%lld", (long long) stats->movieOffset);
+    }
+    if (result != kQTVRFixNoErr) {
+        fprintf(file, "\t%d", result);
+    }
+    fputc('\n', file);
+}
+
+// Parses the patch list back into mask ranges; the byte values aren't needed to verify
+static uint32_t parse_patch_list(const char *text, QTVRFixPatch **patches)
+{
+    uint32_t count = 0, capacity = 0;
+    *patches = NULL;
+    
+    while (*text && *text != '-') {
+        long long offset;
+        unsigned length;
+        int consumed = 0;
+        if (sscanf(text, "%lld+%u%n", &offset, &length, &consumed) != 2) {
+            break;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            *patches = realloc(*patches, capacity * sizeof(QTVRFixPatch));
+        }
+        memset(&(*patches)[count], 0, sizeof(QTVRFixPatch));
+        (*patches)[count].offset = offset;
+        (*patches)[count].length = length;
+        count++;
+        
+        text += consumed;
+        text += strcspn(text, ",");
+        if (*text == ',') {
+            text++;
+        }
+    }
+    return count;
+}
+
+// Grows memory kept from one record to the next. Returns NULL, leaving it as it was, on failure.
+static void *grow_scratch(void **data, size_t *size, size_t needed)
+{
+    if (needed > *size) {
+        void *larger = realloc(*data, needed);
+        if (!larger) {
+            return NULL;
+        }
+        *data = larger;
+        *size = needed;
+    }
+    return *data;
+}
+
+int digest_verify_records (const char *recordPath, int threads)
+{
+    FILE *records = fopen(recordPath, "r");
+    if (!records) {
+        fprintf(stderr, "Could not open digest records %s: %d\n", recordPath, errno);
+        return 1;
+    }
+    
+    int failures = 0;
+    unsigned long verified = 0;
+    // A movie with many patches makes a long line, so lines aren't limited in length
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    void *buffers = NULL, *chunkHashes = NULL;
+    size_t buffersSize = 0, chunkHashesSize = 0;
+    
+    while (getline(&line, &lineCapacity, records) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        
+        char *fields[6];
+        char *cursor = line;
+        int fieldCount = 0;
+        while (fieldCount < 6 && cursor) {
+            fields[fieldCount++] = cursor;
+            cursor = strchr(cursor, '\t');
+            if (cursor) {
+                *cursor++ = '\0';
+            }
+        }
+        if (fieldCount < 4) {
+            fprintf(stderr, "%s: skipping malformed line\n", recordPath);
+            continue;
+        }
+        unescape_path(fields[3]);
+        const char *moviePath = fields[3];
+        
+        QTVRFixPatch *masks;
+        uint32_t maskCount = parse_patch_list(fields[2], &masks);
+        long long expectedSize = atoll(fields[1]);
+        long long start = (fieldCount > 4) ? atoll(fields[4]) : 0;
+        char where[64] = "";
+        if (start) {
+            // Archive members are named by where their data starts
+            snprintf(where, sizeof(where), " @%lld", start);
+        }
+        if (fieldCount > 5) {
+            int result = atoi(fields[5]);
+            snprintf(where + strlen(where), sizeof(where) - strlen(where), " (%s when recorded)", qtvrfix_result_name(result));
+        }
+        
+        int fd = open(moviePath, O_RDONLY);
+        struct stat fs;
+        uint8_t digest[DIGEST_SIZE];
+        char hex[DIGEST_SIZE * 2 + 1];
+        
+        if (fd == -1) {
+            printf("MISSING   %s%s\n", moviePath, where);
+            failures++;
+        } else if (fstat(fd, &fs) != 0 || (start ? fs.st_size < start + expectedSize : fs.st_size != expectedSize)) {
+            printf("SIZE      %s%s (%lld bytes, expected %lld)\n", moviePath, where, (long long) fs.st_size, start + expectedSize);
+            failures++;
+        } else if (digest_file(fd, start, expectedSize, masks, maskCount, threads,
+                               grow_scratch(&buffers, &buffersSize, digest_buffers_size(expectedSize, threads)),
+                               grow_scratch(&chunkHashes, &chunkHashesSize, digest_hashes_size(expectedSize)), NULL, digest) != 0) {
+            printf("ERROR     %s%s (read failed)\n", moviePath, where);
+            failures++;
+        } else {
+            format_digest(digest, hex);
+            if (strcmp(hex, fields[0]) == 0) {
+                printf("OK        %s%s\n", moviePath, where);
+                verified++;
+            } else {
+                printf("MISMATCH  %s%s\n", moviePath, where);
+                failures++;
+            }
+        }
+        
+        if (fd != -1) {
+            close(fd);
+        }
+        free(masks);
+    }
+    
+    printf("%lu verified, %d failed\n", verified, failures);
+    free(line);
+    free(buffers);
+    free(chunkHashes);
+    fclose(records);
+    return failures;
+}
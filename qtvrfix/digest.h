@@ -0,0 +1,48 @@
+//
+//  digest.h
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QTVRFIX_DIGEST_H
+#define QTVRFIX_DIGEST_H
+
+#include <stdio.h>
+#include "qtvrfix.h"
+
+#define DIGEST_SIZE     16
+#define DIGEST_CHUNK_SIZE   (4 * 1024 * 1024)
+
+// Hashes length bytes of fd starting at start, with the patched ranges (offsets relative
+// to start) read as zeros. The file is split into fixed-size chunks hashed by up to
+// threads threads, so the result doesn't depend on the thread count. buffers holds
+// digest_buffers_size() bytes, one chunk buffer per thread, and chunkHashes holds
+// digest_hashes_size() bytes; callers hashing many files can keep them between calls.
+// Pass NULL for either to have it allocated. Fails once *cancel is nonzero, if cancel isn't NULL.
+int digest_file (int fd, off_t start, off_t length, const QTVRFixPatch *masks, uint32_t maskCount, int threads, uint8_t *buffers,
+                 uint64_t *chunkHashes, volatile const int *cancel, uint8_t digest[DIGEST_SIZE]);
+size_t digest_buffers_size (off_t length, int threads);
+size_t digest_hashes_size (off_t length);
+
+// One line per movie: digest, size, patches and path, and result when it isn't kQTVRFixNoErr
+void digest_write_record (FILE *file, const char *moviePath, const QTVRFixStats *stats, int result);
+
+// Recomputes every digest in a record file. Returns the number of mismatches or errors.
+int digest_verify_records (const char *recordPath, int threads);
+
+#endif
@@ -0,0 +1,144 @@
+//
+//  fuzz_qtvrfix.c
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Fuzzing harness for the parser. Each input is written to a memory file (a temporary
+// file where memfd_create() isn't available), repaired in place with qtvrfix_member()
+// and then inspected. It isn't part of the Xcode targets; build it with libFuzzer:
+//
+//   clang -std=gnu99 -g -O1 -fsanitize=fuzzer,address,undefined -Wno-multichar fuzz_qtvrfix.c qtvrfix_c.c digest.c -o fuzz_qtvrfix
+//
+// or add -DQTVRFIX_FUZZ_STANDALONE (and drop "fuzzer") for a program that runs the files
+// named on its command line, or stdin, as AFL expects.
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "qtvrfix.h"
+
+// Returns a read-write descriptor holding the data and its path for qtvrfix_inspect()
+static int open_input(const uint8_t *data, size_t size, char *path, size_t pathSize)
+{
+    int fd = -1;
+#if defined(MFD_CLOEXEC)
+    fd = memfd_create("qtvrfix-fuzz", MFD_CLOEXEC);
+    if (fd != -1) {
+        snprintf(path, pathSize, "/proc/self/fd/%d", fd);
+    }
+#endif
+    if (fd == -1) {
+        snprintf(path, pathSize, "/tmp/qtvrfix-fuzz-XXXXXX");
+        fd = mkstemp(path);
+        if (fd == -1) {
+            return -1;
+        }
+    }
+    
+    if (pwrite(fd, data, size, 0) != (ssize_t) size) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static QTVRFixWorkspace *workspace;
+    static FILE *sink;
+    if (!workspace) {
+        workspace = qtvrfix_workspace_create(0);
+        sink = fopen("/dev/null", "w");
+    }
+    
+    char path[64];
+    int fd = open_input(data, size, path, sizeof(path));
+    if (fd == -1) {
+        return 0;
+    }
+    
+    // Both ways of reaching the samples, and the digest and catalog lists
+    QTVRFixOptions options;
+    memset(&options, 0, sizeof(QTVRFixOptions));
+    options.ioStrategy = (size & 1) ? kQTVRFixIOPread : kQTVRFixIOMmap;
+    options.digest = 1;
+    options.digestThreads = 1;
+    options.catalog = 1;
+    options.workspace = workspace;
+    
+    QTVRFixStats stats;
+    qtvrfix_member(fd, 0, size, path, &options, &stats);
+    qtvrfix_stats_free(&stats);
+    qtvrfix_inspect(path, kQTVRFixInspectJSON, sink);
+    
+    if (strncmp(path, "/tmp/", 5) == 0) {
+        unlink(path);
+    }
+    close(fd);
+    return 0;
+}
+
+#if defined(QTVRFIX_FUZZ_STANDALONE)
+
+static void run_file(FILE *input)
+{
+    size_t size = 0, capacity = 64 * 1024;
+    uint8_t *data = malloc(capacity);
+    size_t count;
+    while (data && (count = fread(data + size, 1, capacity - size, input)) > 0) {
+        size += count;
+        if (size == capacity) {
+            uint8_t *larger = realloc(data, capacity * 2);
+            if (!larger) {
+                break;
+            }
+            data = larger;
+            capacity *= 2;
+        }
+    }
+    if (data) {
+        LLVMFuzzerTestOneInput(data, size);
+    }
+    free(data);
+}
+
+int main (int argc, const char * argv[])
+{
+    if (argc < 2) {
+        run_file(stdin);
+    }
+    for (int i = 1; i < argc; i++) {
+        FILE *input = fopen(argv[i], "rb");
+        if (input) {
+            run_file(input);
+            fclose(input);
+        }
+    }
+    return 0;
+}
+
+#endif
@@ -20,24 +20,947 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 #include "qtvrfix.h"
+#include "manifest.h"
+#include "digest.h"
+#include "catalog.h"
+#include "batch.h"
+#include "tar.h"
+#include "progress.h"
+#include "watchdog.h"
 
+// Tries left for a movie another process has locked, and the wait before the first;
+// each later wait doubles
+static const int cMaxBusyRetries = 5;
+static const double cBusyRetryDelay = 1.0;
 
-int main (int argc, const char * argv[])
+// Which files a node owns when the corpus is split with --shard i/N
+typedef struct _ShardSpec {
+    unsigned  index;        // 1-based
+    unsigned  count;
+    int       byInode;
+} ShardSpec;
+
+static uint64_t hash_path(const char *path)
 {
+    // FNV-1a, stable across hosts and runs
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *c = (const unsigned char *)path; *c; c++) {
+        hash ^= *c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
 
-    if (argc == 1) {
-        printf("usage: qtvrfix [qtvr.mov ...]\n");
-        printf("       Modifies the specified QTVR movie files in-place to fix a crashing bug which \n");
-        printf("       occurs when the movie is played using QuickTime 7.6.9 or later.\n");
-        printf("       The modifications are backwards-compatible. Non-QTVR movies will not be affected.\n");
+static uint64_t hash_inode(uint64_t inode)
+{
+    // splitmix64 finalizer so sequential inodes spread evenly
+    inode ^= inode >> 30;
+    inode *= 0xbf58476d1ce4e5b9ULL;
+    inode ^= inode >> 27;
+    inode *= 0x94d049bb133111ebULL;
+    inode ^= inode >> 31;
+    return inode;
+}
+
+static int in_shard(const ShardSpec *shard, const char *path)
+{
+    if (shard->count <= 1) {
+        return 1;
+    }
+    
+    uint64_t hash;
+    struct stat fs;
+    if (shard->byInode && stat(path, &fs) == 0) {
+        hash = hash_inode((uint64_t) fs.st_ino);
+    } else {
+        // Missing files fall back to the path so exactly one node reports them
+        hash = hash_path(path);
+    }
+    
+    return (hash % shard->count) + 1 == shard->index;
+}
+
+static double current_time(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// A worker's inspection report, written in one piece once it's complete. The stream is
+// kept from file to file, so its memory only grows.
+typedef struct _InspectBuffer {
+    FILE *          stream;
+    char *          data;
+    size_t          size;
+} InspectBuffer;
+
+// Everything a run needs to process one file
+typedef struct _RunContext {
+    ShardSpec       shard;
+    QTVRFixOptions  options;
+    Manifest        manifest;
+    int             printStats;
+    FILE *          digestRecords;
+    int             catalog;            // descriptor, only used with options.catalog
+    int             inspect;
+    QTVRFixInspectFormat inspectFormat;
+    int             tarArchives;        // inputs are tar archives holding the movies
+    Batch *         batch;
+    QTVRFixWorkspace **workspaces;      // one per worker, created on its first file
+    InspectBuffer * inspectBuffers;     // one per worker with --inspect
+    int             hugePages;
+    pthread_mutex_t outputLock;         // manifest, digest records and stdout
+    Progress *      progress;           // NULL unless --progress
+    ProgressSlot *  progressSlots;      // one per worker, then the submitting thread's and the watchdog's
+    int             producerSlot;
+    int             watchdogSlot;
+    Watchdog *      watchdog;           // NULL unless --deadline
+    double          deadline;
+    pthread_mutex_t retryLock;
+    struct _Job *   retries;            // stalled and busy files, retried once the current pass is done
+} RunContext;
+
+// A tar archive whose members are being fixed
+typedef struct _TarArchive {
+    const char *    path;
+    int             fd;
+    int             patched;
+    int             abandoned;          // a member's worker is still blocked in the archive
+} TarArchive;
+
+// One movie for a worker: a file, or a member of an archive
+typedef struct _Job {
+    char *              path;
+    TarArchive *        archive;
+    const TarMember *   member;
+    int                 retry;
+    QTVRFixPatch *      stalledPatches;     // made before the first attempt stalled, for the retry's digest
+    uint32_t            stalledPatchCount;
+    int                 busyRetries;
+    double              notBefore;          // a busy file waits out its backoff
+    struct _Job *       next;
+} Job;
+
+static int parse_io_strategy(const char *name, QTVRFixIOStrategy *strategy)
+{
+    if (strcmp(name, "auto") == 0) {
+        *strategy = kQTVRFixIOAuto;
+    } else if (strcmp(name, "mmap") == 0) {
+        *strategy = kQTVRFixIOMmap;
+    } else if (strcmp(name, "pread") == 0) {
+        *strategy = kQTVRFixIOPread;
     } else {
-        for (int i = 1; i < argc; i++) {
-            qtvrfix(argv[i]);
+        fprintf(stderr, "Invalid I/O strategy '%s', expected auto, mmap or pread\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+// Parses a comma-separated list of paging hints
+static int parse_map_policy(const char *spec, int *mapPolicy)
+{
+    static const struct { const char *name; int flag; } cPolicies[] = {
+        { "default",   kQTVRFixMapDefault },
+        { "random",    kQTVRFixMapRandom },
+        { "willneed",  kQTVRFixMapWillNeedMoov },
+        { "populate",  kQTVRFixMapPopulateMoov },
+        { "prefetch",  kQTVRFixMapPrefetchSamples }
+    };
+    
+    *mapPolicy = 0;
+    while (*spec) {
+        size_t length = strcspn(spec, ",");
+        int found = 0;
+        for (int i = 0; i < sizeof(cPolicies) / sizeof(cPolicies[0]); i++) {
+            if (strlen(cPolicies[i].name) == length && strncmp(spec, cPolicies[i].name, length) == 0) {
+                *mapPolicy |= cPolicies[i].flag;
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "Invalid map policy '%.*s', expected default, random, willneed, populate or prefetch\n", (int) length, spec);
+            return -1;
+        }
+        spec += length;
+        if (*spec == ',') {
+            spec++;
+        }
+    }
+    return 0;
+}
+
+static int parse_cache_policy(const char *spec, int *cachePolicy)
+{
+    static const struct { const char *name; int flag; } cPolicies[] = {
+        { "default",   kQTVRFixCacheDefault },
+        { "drop",      kQTVRFixCacheDrop },
+        { "direct",    kQTVRFixCacheDirect }
+    };
+    
+    *cachePolicy = 0;
+    while (*spec) {
+        size_t length = strcspn(spec, ",");
+        int found = 0;
+        for (int i = 0; i < sizeof(cPolicies) / sizeof(cPolicies[0]); i++) {
+            if (strlen(cPolicies[i].name) == length && strncmp(spec, cPolicies[i].name, length) == 0) {
+                *cachePolicy |= cPolicies[i].flag;
+                found = 1;
+            }
         }
+        if (!found) {
+            fprintf(stderr, "Invalid cache policy '%.*s', expected default, drop or direct\n", (int) length, spec);
+            return -1;
+        }
+        spec += length;
+        if (*spec == ',') {
+            spec++;
+        }
+    }
+    return 0;
+}
+
+// Parses PREFIX=STRATEGY and appends it to the override list
+static int add_io_override(QTVRFixOptions *options, char *spec)
+{
+    char *equals = strrchr(spec, '=');
+    if (!equals) {
+        fprintf(stderr, "Invalid I/O override '%s', expected PREFIX=STRATEGY\n", spec);
+        return -1;
+    }
+    *equals = '\0';
+    
+    QTVRFixIOOverride override = { spec, kQTVRFixIOAuto };
+    if (parse_io_strategy(equals + 1, &override.strategy)) {
+        return -1;
     }
     
+    QTVRFixIOOverride *overrides = realloc((void *) options->ioOverrides, (options->ioOverrideCount + 1) * sizeof(QTVRFixIOOverride));
+    overrides[options->ioOverrideCount++] = override;
+    options->ioOverrides = overrides;
     return 0;
 }
 
+// Reads a whole text file into a NUL-terminated buffer
+static char *read_text_file(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return NULL;
+    }
+    
+    size_t length = 0, capacity = 4096;
+    char *text = malloc(capacity);
+    size_t count;
+    while ((count = fread(text + length, 1, capacity - length - 1, file)) > 0) {
+        length += count;
+        if (capacity - length == 1) {
+            capacity *= 2;
+            text = realloc(text, capacity);
+        }
+    }
+    text[length] = '\0';
+    fclose(file);
+    return text;
+}
+
+static void print_file_stats(const char *path, int result, const QTVRFixStats *stats)
+{
+    if (result != kQTVRFixNoErr) {
+        printf("%s: %s\n", path, qtvrfix_result_name(result));
+        return;
+    }
+    printf("%s: io=%s (%s), moov at %lld (%llu bytes, %s), %u of %u pano samples updated (%u fields), "
+           "%ld minor/%ld major faults, cache +%llu/-%llu pages, %.3f ms\n",
+           path, qtvrfix_io_strategy_name(stats->ioStrategy), stats->ioReason,
+           (long long) stats->moovOffset, (unsigned long long) stats->moovSize,
+           qtvrfix_moov_locator_name(stats->moovLocator),
+           stats->updatedSamples, stats->panoSamples, stats->patchedFields,
+           stats->minorFaults, stats->majorFaults,
+           (unsigned long long) stats->cachePagesAdded, (unsigned long long) stats->cachePagesDropped,
+           stats->seconds * 1000.0);
+}
+
+// Puts a job on the retry list, to be run again no sooner than notBefore
+static void defer_job(RunContext *context, Job *job, double notBefore)
+{
+    job->notBefore = notBefore;
+    pthread_mutex_lock(&context->retryLock);
+    job->next = context->retries;
+    context->retries = job;
+    pthread_mutex_unlock(&context->retryLock);
+}
+
+static void run_job(void *item, int worker, void *passthrough)
+{
+    Job *job = (Job *) item;
+    RunContext *context = (RunContext *) passthrough;
+    QTVRFixStats stats;
+    int result;
+    
+    if (context->inspect) {
+        // Each report is written to the worker's buffer, then to stdout in one piece
+        InspectBuffer *buffer = &context->inspectBuffers[worker];
+        memset(&stats, 0, sizeof(QTVRFixStats));
+        if (!buffer->stream) {
+            buffer->stream = open_memstream(&buffer->data, &buffer->size);
+        }
+        if (buffer->stream && fseeko(buffer->stream, 0, SEEK_SET) == 0) {
+            result = qtvrfix_inspect(job->path, context->inspectFormat, buffer->stream);
+            off_t length = ftello(buffer->stream);
+            fflush(buffer->stream);
+            pthread_mutex_lock(&context->outputLock);
+            fwrite(buffer->data, 1, (length > 0) ? (size_t) length : 0, stdout);
+        } else {
+            pthread_mutex_lock(&context->outputLock);
+            result = qtvrfix_inspect(job->path, context->inspectFormat, stdout);
+        }
+        manifest_add(&context->manifest, job->path, result, &stats);
+        pthread_mutex_unlock(&context->outputLock);
+        if (context->progress) {
+            progress_file_done(&context->progressSlots[worker], 0, 0, result != kQTVRFixNoErr);
+        }
+        free(job->path);
+        free(job);
+        return;
+    }
+    
+    QTVRFixOptions options = context->options;
+    if (!context->workspaces[worker]) {
+        context->workspaces[worker] = qtvrfix_workspace_create(context->hugePages);
+    }
+    options.workspace = context->workspaces[worker];
+    if (context->watchdog) {
+        double deadline = context->deadline;
+        if (job->retry) {
+            // pread can be interrupted where a page fault in a mapping can't
+            options.ioStrategy = kQTVRFixIOPread;
+            options.ioOverrideCount = 0;
+            options.priorPatches = job->stalledPatches;
+            options.priorPatchCount = job->stalledPatchCount;
+            deadline *= 2;
+        }
+        options.cancel = watchdog_begin(context->watchdog, worker, job, deadline);
+    }
+    
+    if (job->archive) {
+        result = qtvrfix_member(job->archive->fd, job->member->offset, job->member->size, job->path, &options, &stats);
+    } else {
+        result = qtvrfix_with_options(job->path, &options, &stats);
+    }
+    
+    if (context->watchdog) {
+        if (watchdog_end(context->watchdog, worker) != 0) {
+            // Already reported by abandon_job(), and the run may be over
+            return;
+        }
+        if (result == kQTVRFixErrStalled && !job->retry) {
+            // Samples written before the cancel stay patched, so the retry must mask them
+            // in its digest even though it won't change them again
+            if (stats.patchCount) {
+                job->stalledPatches = malloc(stats.patchCount * sizeof(QTVRFixPatch));
+                if (job->stalledPatches) {
+                    memcpy(job->stalledPatches, stats.patches, stats.patchCount * sizeof(QTVRFixPatch));
+                    job->stalledPatchCount = stats.patchCount;
+                }
+            }
+            if (job->archive && stats.patchedFields) {
+                pthread_mutex_lock(&context->outputLock);
+                job->archive->patched = 1;
+                pthread_mutex_unlock(&context->outputLock);
+            }
+            qtvrfix_stats_free(&stats);
+            job->retry = 1;
+            defer_job(context, job, 0);
+            return;
+        }
+    }
+    if (result == kQTVRFixErrBusy && job->busyRetries < cMaxBusyRetries) {
+        // Skipped rather than waited for, so the worker moves on to the next file
+        qtvrfix_stats_free(&stats);
+        defer_job(context, job, current_time() + cBusyRetryDelay * (1 << job->busyRetries));
+        job->busyRetries++;
+        return;
+    }
+    if (result == kQTVRFixErrStalled) {
+        fprintf(stderr, "%s: stalled again on retry, giving up\n", job->path);
+    } else if (result == kQTVRFixErrBusy) {
+        fprintf(stderr, "%s: still locked by another process, giving up\n", job->path);
+    }
+    if (context->progress) {
+        progress_file_done(&context->progressSlots[worker], stats.fileSize, stats.patchedFields, result != kQTVRFixNoErr);
+    }
+    if (context->options.catalog && (result == kQTVRFixNoErr || result == kQTVRFixErrMalformed)) {
+        // Each entry is a single append, so this needs no lock
+        catalog_append(context->catalog, job->archive ? job->archive->path : job->path, &stats);
+    }
+    
+    pthread_mutex_lock(&context->outputLock);
+    manifest_add(&context->manifest, job->path, result, &stats);
+    if (context->printStats) {
+        print_file_stats(job->path, result, &stats);
+    }
+    if (context->digestRecords && stats.hasDigest) {
+        // Members are verified through the archive and the offset in the record
+        digest_write_record(context->digestRecords, job->archive ? job->archive->path : job->path, &stats, result);
+    }
+    if (job->archive && stats.patchedFields) {
+        job->archive->patched = 1;
+    }
+    pthread_mutex_unlock(&context->outputLock);
+    
+    qtvrfix_stats_free(&stats);
+    free(job->stalledPatches);
+    free(job->path);
+    if (!job->archive) {
+        free(job);  // member jobs belong to process_archive()
+    }
+}
+
+// Counts a file on the submitting thread's progress slot
+static void note_queued(RunContext *context)
+{
+    if (context->progress) {
+        progress_file_queued(&context->progressSlots[context->producerSlot]);
+    }
+}
+
+// Records a failure found before any worker saw the file
+static void add_failure(RunContext *context, const char *path, int result)
+{
+    QTVRFixStats noStats;
+    memset(&noStats, 0, sizeof(QTVRFixStats));
+    
+    pthread_mutex_lock(&context->outputLock);
+    manifest_add(&context->manifest, path, result, &noStats);
+    pthread_mutex_unlock(&context->outputLock);
+    if (context->progress) {
+        ProgressSlot *slot = &context->progressSlots[context->producerSlot];
+        progress_file_queued(slot);
+        progress_file_done(slot, 0, 0, 1);
+    }
+}
+
+// Called by the watchdog for a worker that stayed blocked well past the deadline.
+// The file is reported as stalled and a new worker takes over the queue.
+static void abandon_job(int worker, void *item, void *passthrough)
+{
+    Job *job = (Job *) item;
+    RunContext *context = (RunContext *) passthrough;
+    QTVRFixStats noStats;
+    memset(&noStats, 0, sizeof(QTVRFixStats));
+    
+    fprintf(stderr, "%s: still blocked after twice the deadline, moving on\n", job->path);
+    pthread_mutex_lock(&context->outputLock);
+    manifest_add(&context->manifest, job->path, kQTVRFixErrStalled, &noStats);
+    if (context->printStats) {
+        print_file_stats(job->path, kQTVRFixErrStalled, &noStats);
+    }
+    if (job->archive) {
+        job->archive->abandoned = 1;
+    }
+    pthread_mutex_unlock(&context->outputLock);
+    if (context->progress) {
+        progress_file_done(&context->progressSlots[context->watchdogSlot], 0, 0, 1);
+    }
+    
+    // The blocked call still uses the worker's workspace, so it is left to it
+    context->workspaces[worker] = NULL;
+    batch_retire_worker(context->batch, worker);
+}
+
+// Waits for the current pass, then gives stalled files one more try and busy files
+// more tries as their backoff runs out, until none are left
+static void run_retries(RunContext *context)
+{
+    for (;;) {
+        batch_wait(context->batch);
+        
+        pthread_mutex_lock(&context->retryLock);
+        Job *job = context->retries;
+        context->retries = NULL;
+        pthread_mutex_unlock(&context->retryLock);
+        if (!job) {
+            return;
+        }
+        
+        // Nothing else is running, so sleep until the earliest is due
+        double due = job->notBefore;
+        for (Job *other = job->next; other; other = other->next) {
+            if (other->notBefore < due) {
+                due = other->notBefore;
+            }
+        }
+        double wait = due - current_time();
+        if (wait > 0) {
+            struct timespec delay;
+            delay.tv_sec = (time_t) wait;
+            delay.tv_nsec = (long)((wait - delay.tv_sec) * 1e9);
+            while (nanosleep(&delay, &delay) == -1 && errno == EINTR);
+        }
+        
+        double now = current_time();
+        Job *later = NULL, *lastLater = NULL;
+        while (job) {
+            Job *next = job->next;
+            if (job->notBefore <= now) {
+                batch_submit(context->batch, job);
+            } else {
+                job->next = later;
+                later = job;
+                if (!lastLater) {
+                    lastLater = job;
+                }
+            }
+            job = next;
+        }
+        if (later) {
+            pthread_mutex_lock(&context->retryLock);
+            lastLater->next = context->retries;
+            context->retries = later;
+            pthread_mutex_unlock(&context->retryLock);
+        }
+    }
+}
+
+static int has_movie_extension(const char *name)
+{
+    size_t length = strlen(name);
+    return length > 4 && strcasecmp(name + length - 4, ".mov") == 0;
+}
+
+// Fixes the .mov members of a tar archive in place, in parallel, then syncs the archive once
+static void process_archive(const char *path, RunContext *context)
+{
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        fprintf(stderr, "File not found: %s\n", path);
+        add_failure(context, path, kQTVRFixErrNotFound);
+        return;
+    }
+    struct stat fs;
+    fstat(fd, &fs);
+    
+    TarIndex index;
+    char error[256];
+    if (tar_index_read(&index, fd, fs.st_size, error, sizeof(error)) != 0) {
+        // Members before the damage are still fixed
+        fprintf(stderr, "%s: %s\n", path, error);
+        add_failure(context, path, kQTVRFixErrReadFailed);
+    }
+    
+    TarArchive archive = { path, fd, 0, 0 };
+    Job *jobs = calloc(index.count, sizeof(Job));
+    for (int i = 0; i < index.count; i++) {
+        const TarMember *member = &index.members[i];
+        if (!has_movie_extension(member->name)) {
+            continue;
+        }
+        jobs[i].path = malloc(strlen(path) + strlen(member->name) + 2);
+        sprintf(jobs[i].path, "%s:%s", path, member->name);
+        jobs[i].archive = &archive;
+        jobs[i].member = member;
+        note_queued(context);
+        batch_submit(context->batch, &jobs[i]);
+    }
+    run_retries(context);
+    
+    if (archive.patched && fsync(fd) == -1) {
+        fprintf(stderr, "Error writing archive %s: %d\n", path, errno);
+    }
+    if (archive.abandoned) {
+        // A blocked worker may still write through fd, so it mustn't be reused
+        fprintf(stderr, "%s: leaving the archive open for a stalled member\n", path);
+        return;
+    }
+    close(fd);
+    free(jobs);
+    tar_index_free(&index);
+}
+
+static void process_file(const char *path, RunContext *context)
+{
+    if (!in_shard(&context->shard, path)) {
+        return;
+    }
+    if (context->tarArchives) {
+        process_archive(path, context);
+        return;
+    }
+    
+    Job *job = calloc(1, sizeof(Job));
+    job->path = strdup(path);
+    note_queued(context);
+    batch_submit(context->batch, job);
+}
+
+static void print_usage(void)
+{
+    printf("usage: qtvrfix [options] [qtvr.mov ...]\n");
+    printf("       qtvrfix --merge [--manifest merged.tsv] manifest.tsv ...\n");
+    printf("       Modifies the specified QTVR movie files in-place to fix a crashing bug which \n");
+    printf("       occurs when the movie is played using QuickTime 7.6.9 or later.\n");
+    printf("       The modifications are backwards-compatible. Non-QTVR movies will not be affected.\n");
+    printf("\n");
+    printf("       --files-from FILE   read additional movie paths, one per line ('-' for stdin)\n");
+    printf("       -j, --jobs N        fix N movies at a time (default: 1)\n");
+    printf("       --tar               the paths are uncompressed tar archives; fix their .mov\n");
+    printf("                           members in place without extracting them\n");
+    printf("       --shard i/N         only process the i-th of N disjoint subsets (1 <= i <= N)\n");
+    printf("       --shard-key KEY     partition by 'path' (default) or 'inode'\n");
+    printf("       --manifest FILE     write per-file results and totals to FILE\n");
+    printf("       --merge             combine the given manifests into one report\n");
+    printf("       --io STRATEGY       read movies with 'auto' (default), 'mmap' or 'pread'\n");
+    printf("       --io-override PREFIX=STRATEGY\n");
+    printf("                           use STRATEGY for paths starting with PREFIX (repeatable)\n");
+    printf("       --map-policy LIST   paging hints for mapped files, comma-separated from\n");
+    printf("                           random, willneed, populate, prefetch (default: none)\n");
+    printf("       --rules FILE        also apply the patch rules in FILE (see README)\n");
+    printf("       --no-builtin-rules  don't apply the built-in hot spot repair\n");
+    printf("       --inspect[=FORMAT]  list the box tree, sample tables and pano samples as\n");
+    printf("                           'text' (default) or 'json' instead of fixing\n");
+    printf("       --digest FILE       append a digest of each movie, with the patched bytes\n");
+    printf("                           masked out, and the list of patches to FILE\n");
+    printf("       --verify-digest FILE\n");
+    printf("                           re-hash the movies listed in FILE read-only and compare\n");
+    printf("       --digest-threads N  threads used to hash each movie (default: all CPUs)\n");
+    printf("       --catalog FILE      append the identity of each movie and the 'pdat' atom of\n");
+    printf("                           each of its pano samples to the binary FILE (see README)\n");
+    printf("       --deadline SECONDS  cancel a file that takes longer, retry it with pread after\n");
+    printf("                           the others and report it as stalled if it fails again\n");
+    printf("       --lock              take a non-blocking write lock on each movie; a movie\n");
+    printf("                           another process has locked is retried later\n");
+    printf("       --progress[=SECONDS]\n");
+    printf("                           report files done, bytes, patches, errors, throughput\n");
+    printf("                           and ETA on stderr; live on a terminal, else a line\n");
+    printf("                           every SECONDS (default: 10)\n");
+    printf("       --huge-pages        back large per-worker buffers with huge pages\n");
+    printf("       --cache LIST        page cache handling, comma-separated from drop (release\n");
+    printf("                           the pages each movie brought in) and direct (read the\n");
+    printf("                           movie atom and samples past the cache) (default: none)\n");
+    printf("       --stats             print the I/O decision, sample counts, page faults and\n");
+    printf("                           time for each file\n");
+}
+
+int main (int argc, const char * argv[])
+{
+    static const struct option cLongOptions[] = {
+        { "files-from", required_argument, NULL, 'f' },
+        { "jobs",       required_argument, NULL, 'j' },
+        { "tar",        no_argument,       NULL, 't' },
+        { "shard",      required_argument, NULL, 's' },
+        { "shard-key",  required_argument, NULL, 'k' },
+        { "manifest",   required_argument, NULL, 'm' },
+        { "merge",      no_argument,       NULL, 'M' },
+        { "io",         required_argument, NULL, 'i' },
+        { "io-override", required_argument, NULL, 'o' },
+        { "map-policy", required_argument, NULL, 'p' },
+        { "rules",      required_argument, NULL, 'r' },
+        { "no-builtin-rules", no_argument, NULL, 'R' },
+        { "inspect",    optional_argument, NULL, 'I' },
+        { "digest",     required_argument, NULL, 'd' },
+        { "verify-digest", required_argument, NULL, 'V' },
+        { "digest-threads", required_argument, NULL, 'T' },
+        { "catalog",    required_argument, NULL, 'c' },
+        { "progress",   optional_argument, NULL, 'P' },
+        { "deadline",   required_argument, NULL, 'D' },
+        { "lock",       no_argument,       NULL, 'L' },
+        { "huge-pages", no_argument,       NULL, 'H' },
+        { "cache",      required_argument, NULL, 'C' },
+        { "stats",      no_argument,       NULL, 'S' },
+        { "help",       no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    
+    RunContext context;
+    memset(&context, 0, sizeof(RunContext));
+    ShardSpec *shard = &context.shard;
+    shard->index = shard->count = 1;
+    const char *filesFrom = NULL;
+    const char *manifestPath = NULL;
+    const char *rulesPath = NULL;
+    const char *digestPath = NULL;
+    const char *verifyPath = NULL;
+    const char *catalogPath = NULL;
+    int builtInRules = 1;
+    int jobs = 1;
+    int showProgress = 0;
+    double progressInterval = 0;
+    int merge = 0;
+    int option;
+    
+    if (argc == 1) {
+        print_usage();
+        return 0;
+    }
+    
+    while ((option = getopt_long(argc, (char * const *)argv, "hj:", cLongOptions, NULL)) != -1) {
+        switch (option) {
+            case 'f':
+                filesFrom = optarg;
+                break;
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1) {
+                    fprintf(stderr, "Invalid job count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                context.tarArchives = 1;
+                break;
+            case 's':
+                if (sscanf(optarg, "%u/%u", &shard->index, &shard->count) != 2 ||
+                    shard->count == 0 || shard->index < 1 || shard->index > shard->count) {
+                    fprintf(stderr, "Invalid shard '%s', expected i/N with 1 <= i <= N\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'k':
+                if (strcmp(optarg, "inode") == 0) {
+                    shard->byInode = 1;
+                } else if (strcmp(optarg, "path") == 0) {
+                    shard->byInode = 0;
+                } else {
+                    fprintf(stderr, "Invalid shard key '%s', expected 'path' or 'inode'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                manifestPath = optarg;
+                break;
+            case 'M':
+                merge = 1;
+                break;
+            case 'i':
+                if (parse_io_strategy(optarg, &context.options.ioStrategy)) {
+                    return 1;
+                }
+                break;
+            case 'o':
+                if (add_io_override(&context.options, optarg)) {
+                    return 1;
+                }
+                break;
+            case 'p':
+                if (parse_map_policy(optarg, &context.options.mapPolicy)) {
+                    return 1;
+                }
+                break;
+            case 'r':
+                rulesPath = optarg;
+                break;
+            case 'R':
+                builtInRules = 0;
+                break;
+            case 'I':
+                context.inspect = 1;
+                if (optarg && strcmp(optarg, "json") == 0) {
+                    context.inspectFormat = kQTVRFixInspectJSON;
+                } else if (optarg && strcmp(optarg, "text") != 0) {
+                    fprintf(stderr, "Invalid inspect format '%s', expected text or json\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'd':
+                digestPath = optarg;
+                context.options.digest = 1;
+                break;
+            case 'V':
+                verifyPath = optarg;
+                break;
+            case 'c':
+                catalogPath = optarg;
+                break;
+            case 'T':
+                context.options.digestThreads = atoi(optarg);
+                break;
+            case 'P':
+                showProgress = 1;
+                if (optarg) {
+                    progressInterval = atof(optarg);
+                    if (progressInterval <= 0) {
+                        fprintf(stderr, "Invalid progress interval '%s'\n", optarg);
+                        return 1;
+                    }
+                }
+                break;
+            case 'D':
+                context.deadline = atof(optarg);
+                if (context.deadline <= 0) {
+                    fprintf(stderr, "Invalid deadline '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'L':
+                context.options.lock = 1;
+                break;
+            case 'S':
+                context.printStats = 1;
+                break;
+            case 'H':
+                context.hugePages = 1;
+                break;
+            case 'C':
+                if (parse_cache_policy(optarg, &context.options.cachePolicy)) {
+                    return 1;
+                }
+                break;
+            default:
+                print_usage();
+                return (option == 'h') ? 0 : 1;
+        }
+    }
+    
+    if (context.options.digestThreads <= 0) {
+        // Share the CPUs between the movies being fixed at once
+        context.options.digestThreads = (int) sysconf(_SC_NPROCESSORS_ONLN) / jobs;
+        if (context.options.digestThreads < 1) {
+            context.options.digestThreads = 1;
+        }
+    }
+    if (verifyPath) {
+        return digest_verify_records(verifyPath, context.options.digestThreads) ? 1 : 0;
+    }
+    
+    if (merge) {
+        return manifest_merge(manifestPath, argc - optind, (char * const *)argv + optind) ? 1 : 0;
+    }
+    
+    QTVRFixRuleSet *rules = NULL;
+    if (rulesPath || !builtInRules) {
+        char *rulesText = rulesPath ? read_text_file(rulesPath) : NULL;
+        char error[256];
+        if (rulesPath && !rulesText) {
+            return 1;
+        }
+        rules = qtvrfix_rules_create(rulesText, builtInRules, error, sizeof(error));
+        free(rulesText);
+        if (!rules) {
+            fprintf(stderr, "%s: %s\n", rulesPath ? rulesPath : "rules", error);
+            return 1;
+        }
+        context.options.rules = rules;
+    }
+    
+    if (digestPath) {
+        context.digestRecords = fopen(digestPath, "a");
+        if (!context.digestRecords) {
+            fprintf(stderr, "Could not open digest file %s\n", digestPath);
+            return 1;
+        }
+    }
+    
+    if (context.inspect && context.tarArchives) {
+        fprintf(stderr, "--inspect can't read tar archives\n");
+        return 1;
+    }
+    if (catalogPath) {
+        if (context.inspect) {
+            fprintf(stderr, "--catalog is written while fixing, not with --inspect\n");
+            return 1;
+        }
+        context.catalog = catalog_open(catalogPath);
+        if (context.catalog == -1) {
+            return 1;
+        }
+        context.options.catalog = 1;
+    }
+    if (context.inspect) {
+        // Inspection output is large; write it in big blocks
+        setvbuf(stdout, NULL, _IOFBF, 1024 * 1024);
+    }
+    
+    if (manifest_open(&context.manifest, manifestPath, shard->index, shard->count, shard->byInode ? "inode" : "path")) {
+        return 1;
+    }
+    double startTime = current_time();
+    pthread_mutex_init(&context.outputLock, NULL);
+    pthread_mutex_init(&context.retryLock, NULL);
+    context.batch = batch_create(jobs, run_job, &context);
+    if (!context.batch) {
+        fprintf(stderr, "Could not start worker threads\n");
+        return 1;
+    }
+    
+    // Replacement workers get their own slots
+    int maxWorkers = batch_max_workers(context.batch);
+    context.workspaces = calloc(maxWorkers, sizeof(QTVRFixWorkspace *));
+    context.inspectBuffers = context.inspect ? calloc(maxWorkers, sizeof(InspectBuffer)) : NULL;
+    context.producerSlot = maxWorkers;
+    context.watchdogSlot = maxWorkers + 1;
+    if (showProgress) {
+        context.progress = progress_start(maxWorkers + 2, progressInterval, stderr);
+        context.progressSlots = context.progress ? progress_slot(context.progress, 0) : NULL;
+    }
+    if (context.deadline > 0 && !context.inspect) {
+        context.watchdog = watchdog_start(maxWorkers, abandon_job, &context);
+    }
+    
+    for (int i = optind; i < argc; i++) {
+        process_file(argv[i], &context);
+    }
+    
+    if (filesFrom) {
+        FILE *list = strcmp(filesFrom, "-") ? fopen(filesFrom, "r") : stdin;
+        if (!list) {
+            fprintf(stderr, "Could not open file list %s\n", filesFrom);
+        } else {
+            char path[4096];
+            while (fgets(path, sizeof(path), list)) {
+                path[strcspn(path, "\r\n")] = '\0';
+                if (path[0]) {
+                    process_file(path, &context);
+                }
+            }
+            if (list != stdin) {
+                fclose(list);
+            }
+        }
+    }
+    
+    if (context.progress) {
+        progress_input_done(context.progress);
+    }
+    run_retries(&context);
+    batch_free(context.batch);
+    watchdog_stop(context.watchdog);
+    progress_stop(context.progress);
+    for (int i = 0; i < maxWorkers; i++) {
+        qtvrfix_workspace_free(context.workspaces[i]);
+    }
+    free(context.workspaces);
+    for (int i = 0; context.inspectBuffers && i < maxWorkers; i++) {
+        if (context.inspectBuffers[i].stream) {
+            fclose(context.inspectBuffers[i].stream);
+        }
+        free(context.inspectBuffers[i].data);
+    }
+    free(context.inspectBuffers);
+    pthread_mutex_destroy(&context.outputLock);
+    manifest_close(&context.manifest, current_time() - startTime);
+    qtvrfix_rules_free(rules);
+    if (context.digestRecords) {
+        fclose(context.digestRecords);
+    }
+    if (context.options.catalog) {
+        close(context.catalog);
+    }
+    
+    return 0;
+}
@@ -0,0 +1,367 @@
+//
+//  manifest.c
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "manifest.h"
+
+#define MANIFEST_VERSION    2
+#define MAX_LINE_LENGTH     16384
+#define MAX_RESULT_CODES    32
+
+#pragma mark Writing
+
+static void write_escaped_path(FILE *file, const char *path)
+{
+    for (const char *c = path; *c; c++) {
+        switch (*c) {
+            case '\\': fputs("\\\\", file); break;
+            case '\t': fputs("\\t", file); break;
+            case '\n': fputs("\\n", file); break;
+            default:   fputc(*c, file); break;
+        }
+    }
+}
+
+int manifest_open (Manifest *manifest, const char *path, unsigned shardIndex, unsigned shardCount, const char *shardKey)
+{
+    memset(manifest, 0, sizeof(Manifest));
+    
+    if (path) {
+        manifest->file = fopen(path, "w");
+        if (!manifest->file) {
+            fprintf(stderr, "Could not create manifest %s: %d\n", path, errno);
+            return -1;
+        }
+        fprintf(manifest->file, "# qtvrfix manifest %d\n", MANIFEST_VERSION);
+        fprintf(manifest->file, "# shard %u/%u %s\n", shardIndex, shardCount, shardKey);
+    }
+    
+    return 0;
+}
+
+void manifest_add (Manifest *manifest, const char *moviePath, int result, const QTVRFixStats *stats)
+{
+    manifest->totals.files++;
+    manifest->totals.bytes += stats->fileSize;
+    manifest->totals.updatedSamples += stats->updatedSamples;
+    if (result == kQTVRFixErrStalled) {
+        manifest->totals.stalled++;
+    } else if (result != kQTVRFixNoErr) {
+        manifest->totals.errors++;
+    } else if (stats->patchedFields > 0) {
+        // Track-level rules can change a movie without touching a sample
+        manifest->totals.updatedFiles++;
+    }
+    
+    if (manifest->file) {
+        fprintf(manifest->file, "%d\t%u\t%u\t%u\t%lld\t", result, stats->panoSamples, stats->updatedSamples, stats->patchedFields,
+                (long long) stats->fileSize);
+        write_escaped_path(manifest->file, moviePath);
+        fputc('\n', manifest->file);
+    }
+}
+
+static void write_totals(FILE *file, const ManifestTotals *totals, double seconds)
+{
+    fprintf(file, "# totals files=%lu updated=%lu errors=%lu stalled=%lu bytes=%llu samples=%llu seconds=%.3f\n",
+            totals->files, totals->updatedFiles, totals->errors, totals->stalled, totals->bytes, totals->updatedSamples, seconds);
+}
+
+void manifest_close (Manifest *manifest, double seconds)
+{
+    if (manifest->file) {
+        write_totals(manifest->file, &manifest->totals, seconds);
+        fclose(manifest->file);
+        manifest->file = NULL;
+    }
+}
+
+
+#pragma mark Merging
+
+// Open-addressed set of paths, used to catch files claimed by more than one shard
+typedef struct _PathSet {
+    char **  slots;
+    size_t   capacity;
+    size_t   count;
+} PathSet;
+
+static uint64_t hash_string(const char *str)
+{
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+        hash ^= *c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int path_set_insert_slot(char **slots, size_t capacity, char *path)
+{
+    size_t index = hash_string(path) & (capacity - 1);
+    while (slots[index]) {
+        if (strcmp(slots[index], path) == 0) {
+            return 0;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+    slots[index] = path;
+    return 1;
+}
+
+// Returns 1 if added, 0 if already present
+static int path_set_add(PathSet *set, const char *path)
+{
+    if ((set->count + 1) * 2 > set->capacity) {
+        size_t newCapacity = set->capacity ? set->capacity * 2 : 1024;
+        char **newSlots = calloc(newCapacity, sizeof(char *));
+        for (size_t i = 0; i < set->capacity; i++) {
+            if (set->slots[i]) {
+                path_set_insert_slot(newSlots, newCapacity, set->slots[i]);
+            }
+        }
+        free(set->slots);
+        set->slots = newSlots;
+        set->capacity = newCapacity;
+    }
+    
+    char *copy = strdup(path);
+    if (path_set_insert_slot(set->slots, set->capacity, copy)) {
+        set->count++;
+        return 1;
+    }
+    free(copy);
+    return 0;
+}
+
+static void path_set_free(PathSet *set)
+{
+    for (size_t i = 0; i < set->capacity; i++) {
+        free(set->slots[i]);
+    }
+    free(set->slots);
+}
+
+static void unescape_path(char *path)
+{
+    char *out = path;
+    for (char *in = path; *in; in++) {
+        if (*in == '\\' && in[1]) {
+            in++;
+            *out++ = (*in == 't') ? '\t' : (*in == 'n') ? '\n' : *in;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+}
+
+typedef struct _ResultCount {
+    int            result;
+    unsigned long  count;
+} ResultCount;
+
+static void count_result(ResultCount *counts, int *countsUsed, int result)
+{
+    for (int i = 0; i < *countsUsed; i++) {
+        if (counts[i].result == result) {
+            counts[i].count++;
+            return;
+        }
+    }
+    if (*countsUsed < MAX_RESULT_CODES) {
+        counts[*countsUsed].result = result;
+        counts[*countsUsed].count = 1;
+        (*countsUsed)++;
+    }
+}
+
+int manifest_merge (const char *outPath, int count, char * const manifestPaths[])
+{
+    FILE *out = NULL;
+    if (outPath) {
+        out = fopen(outPath, "w");
+        if (!out) {
+            fprintf(stderr, "Could not create manifest %s: %d\n", outPath, errno);
+            return -1;
+        }
+        fprintf(out, "# qtvrfix manifest %d\n", MANIFEST_VERSION);
+        fprintf(out, "# shard 1/1 merged\n");
+    }
+    
+    PathSet paths = { NULL, 0, 0 };
+    ManifestTotals total = { 0 };
+    ResultCount resultCounts[MAX_RESULT_CODES];
+    int resultCodesUsed = 0;
+    unsigned long duplicates = 0;
+    unsigned shardCount = 0;
+    unsigned char *shardSeen = NULL;
+    double slowestSeconds = 0;
+    int status = 0;
+    char *line = malloc(MAX_LINE_LENGTH);
+    
+    for (int m = 0; m < count; m++) {
+        FILE *in = fopen(manifestPaths[m], "r");
+        if (!in) {
+            fprintf(stderr, "Could not open manifest %s: %d\n", manifestPaths[m], errno);
+            status = -1;
+            continue;
+        }
+        
+        unsigned shardIndex = 0, thisShardCount = 0;
+        int version = 1;
+        char shardKey[32] = "?";
+        ManifestTotals totals = { 0 };
+        double seconds = 0;
+        int sawTotals = 0;
+        
+        while (fgets(line, MAX_LINE_LENGTH, in)) {
+            size_t length = strlen(line);
+            if (length > 0 && line[length-1] == '\n') {
+                line[--length] = '\0';
+            }
+            
+            if (line[0] == '#') {
+                if (sscanf(line, "# qtvrfix manifest %d", &version) == 1) {
+                    continue;
+                }
+                if (sscanf(line, "# shard %u/%u %31s", &shardIndex, &thisShardCount, shardKey) >= 2) {
+                    continue;
+                }
+                ManifestTotals nodeTotals = { 0 };
+                // Manifests from before stalled files were counted lack that field
+                if (sscanf(line, "# totals files=%lu updated=%lu errors=%lu stalled=%lu bytes=%llu samples=%llu seconds=%lf",
+                           &nodeTotals.files, &nodeTotals.updatedFiles, &nodeTotals.errors, &nodeTotals.stalled,
+                           &nodeTotals.bytes, &nodeTotals.updatedSamples, &seconds) == 7 ||
+                    sscanf(line, "# totals files=%lu updated=%lu errors=%lu bytes=%llu samples=%llu seconds=%lf",
+                           &nodeTotals.files, &nodeTotals.updatedFiles, &nodeTotals.errors,
+                           &nodeTotals.bytes, &nodeTotals.updatedSamples, &seconds) == 6) {
+                    sawTotals = 1;
+                }
+                continue;
+            }
+            
+            int result;
+            unsigned panoSamples, updatedSamples, patchedFields;
+            long long fileSize;
+            int pathOffset = 0;
+            int parsed;
+            if (version < 2) {
+                // No field count; only updated samples were counted then
+                parsed = sscanf(line, "%d\t%u\t%u\t%lld\t%n", &result, &panoSamples, &updatedSamples, &fileSize, &pathOffset) == 4;
+                patchedFields = updatedSamples;
+            } else {
+                parsed = sscanf(line, "%d\t%u\t%u\t%u\t%lld\t%n", &result, &panoSamples, &updatedSamples, &patchedFields, &fileSize,
+                                &pathOffset) == 5;
+            }
+            if (!parsed || !pathOffset) {
+                fprintf(stderr, "%s: skipping malformed line\n", manifestPaths[m]);
+                continue;
+            }
+            
+            if (out) {
+                fprintf(out, "%d\t%u\t%u\t%u\t%lld\t%s\n", result, panoSamples, updatedSamples, patchedFields, fileSize, line + pathOffset);
+            }
+            
+            totals.files++;
+            totals.bytes += fileSize;
+            totals.updatedSamples += updatedSamples;
+            if (result == kQTVRFixErrStalled) {
+                totals.stalled++;
+            } else if (result != kQTVRFixNoErr) {
+                totals.errors++;
+            } else if (patchedFields > 0) {
+                totals.updatedFiles++;
+            }
+            count_result(resultCounts, &resultCodesUsed, result);
+            
+            unescape_path(line + pathOffset);
+            if (!path_set_add(&paths, line + pathOffset)) {
+                duplicates++;
+            }
+        }
+        fclose(in);
+        
+        printf("%s: shard %u/%u (%s), %lu files, %lu updated, %lu errors, %lu stalled, %llu bytes",
+               manifestPaths[m], shardIndex, thisShardCount, shardKey,
+               totals.files, totals.updatedFiles, totals.errors, totals.stalled, totals.bytes);
+        if (sawTotals) {
+            printf(", %.1f s\n", seconds);
+        } else {
+            printf(", incomplete (no totals line)\n");
+        }
+        
+        if (thisShardCount > 0) {
+            if (!shardCount) {
+                shardCount = thisShardCount;
+                shardSeen = calloc(shardCount + 1, 1);
+            }
+            if (thisShardCount != shardCount) {
+                printf("Warning: %s was written for %u shards, expected %u\n", manifestPaths[m], thisShardCount, shardCount);
+            } else if (shardIndex >= 1 && shardIndex <= shardCount) {
+                if (shardSeen[shardIndex]) {
+                    printf("Warning: shard %u/%u appears more than once\n", shardIndex, shardCount);
+                }
+                shardSeen[shardIndex] = 1;
+            }
+        }
+        if (seconds > slowestSeconds) {
+            slowestSeconds = seconds;
+        }
+        
+        total.files += totals.files;
+        total.updatedFiles += totals.updatedFiles;
+        total.errors += totals.errors;
+        total.stalled += totals.stalled;
+        total.bytes += totals.bytes;
+        total.updatedSamples += totals.updatedSamples;
+    }
+    
+    printf("Total: %lu files, %lu updated (%llu samples), %lu errors, %lu stalled, %llu bytes, slowest shard %.1f s\n",
+           total.files, total.updatedFiles, total.updatedSamples, total.errors, total.stalled, total.bytes, slowestSeconds);
+    for (int i = 0; i < resultCodesUsed; i++) {
+        printf("  %4d %-16s %lu\n", resultCounts[i].result, qtvrfix_result_name(resultCounts[i].result), resultCounts[i].count);
+    }
+    for (unsigned i = 1; i <= shardCount; i++) {
+        if (!shardSeen[i]) {
+            printf("Warning: shard %u/%u is missing\n", i, shardCount);
+        }
+    }
+    if (duplicates) {
+        printf("Warning: %lu files appear in more than one manifest\n", duplicates);
+    }
+    
+    if (out) {
+        write_totals(out, &total, slowestSeconds);
+        fclose(out);
+    }
+    free(shardSeen);
+    free(line);
+    path_set_free(&paths);
+    
+    return status;
+}
@@ -0,0 +1,56 @@
+//
+//  manifest.h
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QTVRFIX_MANIFEST_H
+#define QTVRFIX_MANIFEST_H
+
+#include <stdio.h>
+#include "qtvrfix.h"
+
+// Running totals for one manifest (one node's share of a batch)
+typedef struct _ManifestTotals {
+    unsigned long       files;
+    unsigned long       updatedFiles;   // at least one field patched
+    unsigned long       errors;
+    unsigned long       stalled;        // cancelled at the deadline, not counted as errors
+    unsigned long long  bytes;
+    unsigned long long  updatedSamples;
+} ManifestTotals;
+
+// Result manifest written by a batch run. One tab-separated line per file:
+//   <result code> <pano samples> <updated samples> <patched fields> <file size> <path>
+// Version 1 manifests lack the patched fields. Lines starting with '#' carry the
+// version, the shard header and the closing totals. A file counts as updated once any
+// of its fields was patched.
+typedef struct _Manifest {
+    FILE *          file;
+    ManifestTotals  totals;
+} Manifest;
+
+// Pass NULL for path to only accumulate totals
+int manifest_open (Manifest *manifest, const char *path, unsigned shardIndex, unsigned shardCount, const char *shardKey);
+void manifest_add (Manifest *manifest, const char *moviePath, int result, const QTVRFixStats *stats);
+void manifest_close (Manifest *manifest, double seconds);
+
+// Combine per-node manifests into one manifest (optional) and print a report to stdout
+int manifest_merge (const char *outPath, int count, char * const manifestPaths[]);
+
+#endif
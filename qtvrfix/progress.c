@@ -0,0 +1,218 @@
+//
+//  progress.c
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "progress.h"
+
+// Redraw rate for a terminal
+static const double cTerminalInterval = 0.25;
+// Weight of the latest interval in the smoothed rates
+static const double cRateSmoothing = 0.3;
+
+typedef struct _ProgressTotals {
+    unsigned long       queued;
+    unsigned long       files;
+    unsigned long       patched;
+    unsigned long       errors;
+    unsigned long long  bytes;
+} ProgressTotals;
+
+struct _Progress {
+    ProgressSlot *      slots;
+    int                 slotCount;
+    FILE *              output;
+    int                 isTerminal;
+    double              interval;
+    double              startTime;
+    volatile int        inputDone;
+    
+    pthread_t           thread;
+    pthread_mutex_t     lock;
+    pthread_cond_t      wake;
+    int                 stopping;
+    
+    // Only touched by the reporter thread
+    double              lastTime;
+    ProgressTotals      last;
+    double              fileRate;
+    double              byteRate;
+};
+
+static double current_time(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Reads every slot; values may be a moment stale, which is fine for a report
+static void sum_slots(const Progress *progress, ProgressTotals *totals)
+{
+    memset(totals, 0, sizeof(ProgressTotals));
+    for (int i = 0; i < progress->slotCount; i++) {
+        const ProgressSlot *slot = &progress->slots[i];
+        totals->queued += slot->queued;
+        totals->files += slot->files;
+        totals->patched += slot->patched;
+        totals->errors += slot->errors;
+        totals->bytes += slot->bytes;
+    }
+}
+
+static void format_duration(char *text, size_t size, double seconds)
+{
+    unsigned long s = (unsigned long)(seconds + 0.5);
+    snprintf(text, size, "%lu:%02lu:%02lu", s / 3600, (s / 60) % 60, s % 60);
+}
+
+static void report(Progress *progress, int final)
+{
+    double now = current_time();
+    ProgressTotals totals;
+    sum_slots(progress, &totals);
+    
+    double elapsed = now - progress->lastTime;
+    if (elapsed > 0 && !final) {
+        double fileRate = (totals.files - progress->last.files) / elapsed;
+        double byteRate = (totals.bytes - progress->last.bytes) / elapsed;
+        int first = (progress->lastTime == progress->startTime);
+        progress->fileRate = first ? fileRate : progress->fileRate + cRateSmoothing * (fileRate - progress->fileRate);
+        progress->byteRate = first ? byteRate : progress->byteRate + cRateSmoothing * (byteRate - progress->byteRate);
+    }
+    progress->lastTime = now;
+    progress->last = totals;
+    
+    char elapsedText[32], etaText[32] = "?";
+    format_duration(elapsedText, sizeof(elapsedText), now - progress->startTime);
+    if (progress->fileRate > 0) {
+        // A lower bound while files are still being listed
+        format_duration(etaText, sizeof(etaText) - 1, (totals.queued - totals.files) / progress->fileRate);
+        if (!progress->inputDone) {
+            strcat(etaText, "+");
+        }
+    }
+    
+    if (final) {
+        double seconds = now - progress->startTime;
+        fprintf(progress->output, "%s%lu files, %.1f MB, %lu patched, %lu errors in %s (%.1f files/s, %.1f MB/s)\n",
+                progress->isTerminal ? "\r\033[K" : "",
+                totals.files, totals.bytes / 1e6, totals.patched, totals.errors, elapsedText,
+                seconds > 0 ? totals.files / seconds : 0.0, seconds > 0 ? totals.bytes / 1e6 / seconds : 0.0);
+    } else {
+        fprintf(progress->output, "%s%lu/%lu%s files, %.1f MB, %lu patched, %lu errors, %.1f files/s, %.1f MB/s, elapsed %s, ETA %s%s",
+                progress->isTerminal ? "\r" : "",
+                totals.files, totals.queued, progress->inputDone ? "" : "+",
+                totals.bytes / 1e6, totals.patched, totals.errors,
+                progress->fileRate, progress->byteRate / 1e6, elapsedText, etaText,
+                progress->isTerminal ? "\033[K" : "\n");
+    }
+    fflush(progress->output);
+}
+
+static void *progress_thread(void *argument)
+{
+    Progress *progress = (Progress *) argument;
+    double interval = progress->isTerminal ? cTerminalInterval : progress->interval;
+    
+    pthread_mutex_lock(&progress->lock);
+    while (!progress->stopping) {
+        double wakeTime = current_time() + interval;
+        struct timespec deadline;
+        deadline.tv_sec = (time_t) wakeTime;
+        deadline.tv_nsec = (long)((wakeTime - deadline.tv_sec) * 1e9);
+        
+        int result = 0;
+        while (!progress->stopping && result != ETIMEDOUT) {
+            result = pthread_cond_timedwait(&progress->wake, &progress->lock, &deadline);
+        }
+        if (!progress->stopping) {
+            report(progress, 0);
+        }
+    }
+    pthread_mutex_unlock(&progress->lock);
+    return NULL;
+}
+
+Progress *progress_start (int slots, double interval, FILE *output)
+{
+    Progress *progress = calloc(1, sizeof(Progress));
+    if (!progress) {
+        return NULL;
+    }
+    
+    progress->slotCount = slots;
+    if (posix_memalign((void **) &progress->slots, CACHE_LINE_SIZE, progress->slotCount * sizeof(ProgressSlot)) != 0) {
+        free(progress);
+        return NULL;
+    }
+    memset(progress->slots, 0, progress->slotCount * sizeof(ProgressSlot));
+    
+    progress->output = output;
+    progress->isTerminal = isatty(fileno(output));
+    progress->interval = interval > 0 ? interval : 10;
+    progress->startTime = progress->lastTime = current_time();
+    
+    pthread_mutex_init(&progress->lock, NULL);
+    pthread_cond_init(&progress->wake, NULL);
+    if (pthread_create(&progress->thread, NULL, progress_thread, progress) != 0) {
+        // Still counts, and prints the totals at the end
+        progress->stopping = 1;
+    }
+    return progress;
+}
+
+ProgressSlot *progress_slot (Progress *progress, int slot)
+{
+    return &progress->slots[slot];
+}
+
+void progress_input_done (Progress *progress)
+{
+    progress->inputDone = 1;
+}
+
+void progress_stop (Progress *progress)
+{
+    if (!progress) {
+        return;
+    }
+    
+    pthread_mutex_lock(&progress->lock);
+    int running = !progress->stopping;
+    progress->stopping = 1;
+    pthread_cond_signal(&progress->wake);
+    pthread_mutex_unlock(&progress->lock);
+    if (running) {
+        pthread_join(progress->thread, NULL);
+    }
+    
+    report(progress, 1);
+    pthread_mutex_destroy(&progress->lock);
+    pthread_cond_destroy(&progress->wake);
+    free(progress->slots);
+    free(progress);
+}
@@ -0,0 +1,65 @@
+//
+//  progress.h
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QTVRFIX_PROGRESS_H
+#define QTVRFIX_PROGRESS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#define CACHE_LINE_SIZE     64
+
+// Counters owned by one thread. Only that thread writes them, so they are updated
+// with plain stores; each slot fills its own cache line so workers never share one.
+typedef struct _ProgressSlot {
+    volatile unsigned long          queued;
+    volatile unsigned long          files;
+    volatile unsigned long          patched;
+    volatile unsigned long          errors;
+    volatile unsigned long long     bytes;
+} __attribute__((aligned(CACHE_LINE_SIZE))) ProgressSlot;
+
+typedef struct _Progress Progress;
+
+// Starts a thread that reports on output every interval seconds, or a few times a
+// second in place when output is a terminal. Each thread that counts files gets
+// one of the slots.
+Progress *progress_start (int slots, double interval, FILE *output);
+ProgressSlot *progress_slot (Progress *progress, int slot);
+// All files have been queued, so the ETA is no longer a lower bound
+void progress_input_done (Progress *progress);
+// Prints the final totals and frees the reporter
+void progress_stop (Progress *progress);
+
+static inline void progress_file_queued (ProgressSlot *slot)
+{
+    slot->queued++;
+}
+
+static inline void progress_file_done (ProgressSlot *slot, off_t bytes, int patched, int failed)
+{
+    slot->bytes += bytes;
+    slot->patched += patched ? 1 : 0;
+    slot->errors += failed ? 1 : 0;
+    slot->files++;
+}
+
+#endif
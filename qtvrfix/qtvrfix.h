@@ -20,5 +20,166 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifndef QTVRFIX_H
+#define QTVRFIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+// Result codes returned by qtvrfix()
+enum {
+    kQTVRFixNoErr           =  0,
+    kQTVRFixErrNotFound     = -1,
+    kQTVRFixErrTooLarge     = -2,
+    kQTVRFixErrMapFailed    = -3,
+    kQTVRFixErrWriteFailed  = -4,
+    kQTVRFixErrNoMovie      = -5,
+    kQTVRFixErrReadFailed   = -6,
+    kQTVRFixErrStalled      = -7,   // cancelled through options->cancel, usually by a deadline
+    kQTVRFixErrMalformed    = -8,   // a box, table or sample overran its parent; the rest was still repaired
+    kQTVRFixErrBusy         = -9    // another process holds a lock on the movie (options->lock)
+};
+
+// How a movie's bytes are read and patched
+typedef enum {
+    kQTVRFixIOAuto = 0,     // decide per file from size, filesystem and moov position
+    kQTVRFixIOMmap,         // map the whole file and patch in place
+    kQTVRFixIOPread         // read the moov and each pano sample, write back changed samples
+} QTVRFixIOStrategy;
+
+typedef struct _QTVRFixIOOverride {
+    const char *        pathPrefix;
+    QTVRFixIOStrategy   strategy;
+} QTVRFixIOOverride;
+
+// Paging hints for the mmap strategy, may be combined
+enum {
+    kQTVRFixMapDefault          = 0,
+    kQTVRFixMapRandom           = 1 << 0,   // MADV_RANDOM on the whole mapping
+    kQTVRFixMapWillNeedMoov     = 1 << 1,   // MADV_WILLNEED on the moov pages
+    kQTVRFixMapPopulateMoov     = 1 << 2,   // prefault the moov pages (MAP_POPULATE where available)
+    kQTVRFixMapPrefetchSamples  = 1 << 3    // MADV_WILLNEED every pano sample page before patching
+};
+
+// Page cache handling, may be combined
+enum {
+    kQTVRFixCacheDefault        = 0,
+    kQTVRFixCacheDrop           = 1 << 0,   // afterwards drop the pages the movie brought into the cache
+    kQTVRFixCacheDirect         = 1 << 1    // read the moov and samples past the cache; implies pread
+};
+
+// Compiled set of patch rules. Each line of rule text reads
+//   HANDLER PATH [if FIELD<op>VALUE ...] set FIELD=VALUE ...
+// e.g. "pano sean/pdat if hotSpotSizeX==0 set hotSpotNumFramesX=0 hotSpotNumFramesY=0".
+// See README for the details.
+typedef struct _QTVRFixRuleSet QTVRFixRuleSet;
+
+// Scratch memory reused from one movie to the next: the movie atom and sample buffers
+// for pread, the sample tables and the patch and catalog lists. Each buffer grows to fit
+// the largest movie seen and is never shrunk, so a thread fixing many movies soon stops
+// allocating. Not thread-safe; use one per thread.
+typedef struct _QTVRFixWorkspace QTVRFixWorkspace;
+
+// Pass NULL to qtvrfix_with_options() for the defaults (all zero)
+typedef struct _QTVRFixOptions {
+    QTVRFixIOStrategy           ioStrategy;
+    const QTVRFixIOOverride *   ioOverrides;
+    int                         ioOverrideCount;
+    int                         mapPolicy;
+    const QTVRFixRuleSet *      rules;              // NULL for the built-in repair
+    int                         digest;             // record patches and hash the result
+    int                         digestThreads;
+    int                         catalog;            // keep the 'pdat' atom of every pano sample in stats
+    volatile const int *        cancel;             // stop at the next sample or interrupted read once nonzero
+    QTVRFixWorkspace *          workspace;          // NULL to allocate for each movie
+    int                         cachePolicy;
+    int                         lock;               // take an advisory write lock without waiting for it
+    const struct _QTVRFixPatch *priorPatches;       // left in the movie by an earlier, stalled attempt;
+    uint32_t                    priorPatchCount;    // logged and counted as if made by this one
+} QTVRFixOptions;
+
+// One changed field
+typedef struct _QTVRFixPatch {
+    off_t       offset;
+    uint8_t     length;
+    uint8_t     oldBytes[4];
+    uint8_t     newBytes[4];
+} QTVRFixPatch;
+
+// Size of a pano sample's 'pdat' atom data
+#define QTVRFIX_PDAT_SIZE   84
+
+// One pano sample's 'pdat' atom as it is in the movie after the repair, big-endian
+typedef struct _QTVRFixPanoRecord {
+    uint32_t    track;          // 1-based, counting every track of the movie
+    uint32_t    sample;         // 1-based
+    uint8_t     pdat[QTVRFIX_PDAT_SIZE];
+} QTVRFixPanoRecord;
+
+// How the movie atom was found
+typedef enum {
+    kQTVRFixMoovForward = 0,        // walking top-level boxes from the start
+    kQTVRFixMoovTail,               // read directly from the end of the file
+    kQTVRFixMoovTailConfirmed       // found at the end, then checked against the forward walk
+} QTVRFixMoovLocator;
+
+typedef enum {
+    kQTVRFixInspectText = 0,
+    kQTVRFixInspectJSON         // one JSON object per line
+} QTVRFixInspectFormat;
+
+// Per-file counters filled in by qtvrfix_with_options()
+typedef struct _QTVRFixStats {
+    off_t               movieOffset;    // where the movie starts in its file, nonzero for archive members
+    off_t               fileSize;       // of the movie
+    off_t               moovOffset;
+    uint64_t            moovSize;
+    QTVRFixMoovLocator  moovLocator;
+    uint32_t            panoSamples;
+    uint32_t            updatedSamples;
+    uint32_t            patchedFields;
+    QTVRFixIOStrategy   ioStrategy;
+    const char *        ioReason;       // static string, why ioStrategy was picked
+    QTVRFixPatch *      patches;        // only with options->digest; release with qtvrfix_stats_free()
+    uint32_t            patchCount;
+    int                 hasDigest;
+    uint8_t             digest[16];     // of the file with the patched bytes read as zeros
+    QTVRFixPanoRecord * panoRecords;    // only with options->catalog; released by qtvrfix_stats_free()
+    uint32_t            panoRecordCount;
+    time_t              modifiedTime;   // of the file holding the movie, only with options->catalog
+    int                 inWorkspace;    // patches and panoRecords belong to options->workspace and
+                                        // last until it is used for the next movie
+    long                minorFaults;
+    long                majorFaults;
+    uint64_t            cachePagesAdded;    // pages of the movie cached by the run, with options->cachePolicy
+    uint64_t            cachePagesDropped;  // of those, pages no longer cached at the end
+    double              seconds;
+} QTVRFixStats;
+
 int qtvrfix (const char *moviePath);
+int qtvrfix_with_options (const char *moviePath, const QTVRFixOptions *options, QTVRFixStats *stats);
+void qtvrfix_stats_free (QTVRFixStats *stats);
+
+// hugePages backs buffers of 2 MB and more with huge pages where the system has them
+QTVRFixWorkspace *qtvrfix_workspace_create (int hugePages);
+void qtvrfix_workspace_free (QTVRFixWorkspace *workspace);
+
+// Repairs a movie stored at offset..offset+size of an already open file, such as a
+// member of a tar archive. name is used for messages and I/O overrides. Offsets in
+// stats are relative to offset. Nothing is synced; fsync fd once all members are done.
+int qtvrfix_member (int fd, off_t offset, off_t size, const char *name, const QTVRFixOptions *options, QTVRFixStats *stats);
+const char *qtvrfix_result_name (int result);
+
+// Writes the box tree, sample table summaries and decoded pano samples without changing the file
+int qtvrfix_inspect (const char *moviePath, QTVRFixInspectFormat format, FILE *output);
+
+// Returns NULL and describes the problem in error if the text doesn't compile
+QTVRFixRuleSet *qtvrfix_rules_create (const char *text, int includeBuiltIn, char *error, size_t errorSize);
+void qtvrfix_rules_free (QTVRFixRuleSet *rules);
+
+const char *qtvrfix_moov_locator_name (QTVRFixMoovLocator locator);
+const char *qtvrfix_io_strategy_name (QTVRFixIOStrategy strategy);
 
+#endif
@@ -20,15 +20,41 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#if defined(__linux__)
+// O_DIRECT, sync_file_range() and RUSAGE_THREAD
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#if defined(__linux__)
+#include <sys/vfs.h>
+#else
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif
+#if defined(__APPLE__)
+#include <mach/vm_statistics.h>
+#endif
+
+#include "qtvrfix.h"
+#include "digest.h"
 
 
 typedef struct _BoxHeader {
@@ -65,34 +91,6 @@ typedef struct _box_stsc {
     Box_stsc_entry entry[];
 } Box_stsc;
 
-uint32_t stsc_sample_to_chunk(Box_stsc *stsc, uint32_t sampleIndex)
-{
-    uint32_t entryIndex = 0;
-    uint32_t entryCount = ntohl(stsc->entry_count);
-    uint32_t chunk = 0;
-    
-    do {
-        Box_stsc_entry *thisEntry = &stsc->entry[entryIndex];
-        Box_stsc_entry *nextEntry = &stsc->entry[entryIndex+1];
-        uint32_t firstChunk = ntohl(thisEntry->first_chunk);
-        uint32_t samplesPerChunk = ntohl(thisEntry->samples_per_chunk);
-        
-        if (entryIndex < entryCount - 1) {
-            uint32_t lastChunk = ntohl(nextEntry->first_chunk);
-            
-            if (samplesPerChunk * (lastChunk - firstChunk) > sampleIndex) {
-                // not in this entry
-                continue;
-            }
-        }
-        
-        // 1-based index
-        chunk = 1 + (sampleIndex - firstChunk) / samplesPerChunk;
-    } while (++entryIndex < entryCount);
-    
-    return chunk;
-}
-
 // Sample size box
 typedef struct _Box_stsz {
     FullBox    box;
@@ -112,13 +110,77 @@ typedef struct _Box_stco {
 uint32_t stco_chunk_offset(Box_stco *stco, uint32_t chunkIndex)
 {
     uint32_t offset = 0;
-    if (chunkIndex <= ntohl(stco->entry_count)) {
+    if (chunkIndex >= 1 && chunkIndex <= ntohl(stco->entry_count)) {
         offset = ntohl(stco->chunk_offset[chunkIndex-1]);
     }
     
     return offset;
 }
 
+// File location of one sample
+typedef struct _SampleRange {
+    off_t     offset;
+    uint32_t  size;
+} SampleRange;
+
+// Walks the sample-to-chunk, chunk offset and sample size tables together, filling in
+// the location of every sample. ranges must hold sample_count entries and the tables
+// must have passed sample_tables_fit(). Returns the number of samples located.
+uint32_t build_sample_ranges(Box_stsc *stsc, Box_stco *stco, Box_stsz *stsz, SampleRange *ranges)
+{
+    uint32_t entryCount = ntohl(stsc->entry_count);
+    uint32_t chunkCount = ntohl(stco->entry_count);
+    uint32_t sampleCount = ntohl(stsz->sample_count);
+    uint32_t sampleSize = ntohl(stsz->sample_size);
+    uint32_t sampleIndex = 0;
+    
+    for (uint32_t entryIndex = 0; entryIndex < entryCount && sampleIndex < sampleCount; entryIndex++) {
+        Box_stsc_entry *entry = &stsc->entry[entryIndex];
+        uint32_t firstChunk = ntohl(entry->first_chunk);
+        uint32_t samplesPerChunk = ntohl(entry->samples_per_chunk);
+        // 1-based, inclusive
+        uint32_t lastChunk = (entryIndex + 1 < entryCount) ? ntohl(stsc->entry[entryIndex+1].first_chunk) - 1 : chunkCount;
+        if (lastChunk > chunkCount) {
+            // Also catches a following first_chunk of 0
+            lastChunk = chunkCount;
+        }
+        
+        for (uint32_t chunk = firstChunk; chunk <= lastChunk && sampleIndex < sampleCount; chunk++) {
+            off_t offset = stco_chunk_offset(stco, chunk);
+            
+            for (uint32_t i = 0; i < samplesPerChunk && sampleIndex < sampleCount; i++) {
+                uint32_t size = sampleSize ? sampleSize : ntohl(stsz->entry_size[sampleIndex]);
+                ranges[sampleIndex].offset = offset;
+                ranges[sampleIndex].size = size;
+                offset += size;
+                sampleIndex++;
+            }
+        }
+    }
+    
+    return sampleIndex;
+}
+
+// Checks that the entry counts of the sample tables fit inside their boxes, and that
+// samples of a fixed size could fit in the movie, so the range table stays bounded
+int sample_tables_fit(const Box_stsc *stsc, uint64_t stscSize, const Box_stco *stco, uint64_t stcoSize,
+                      const Box_stsz *stsz, uint64_t stszSize, uint64_t movieSize)
+{
+    if (!stsc || !stco || !stsz ||
+        stscSize < sizeof(Box_stsc) || stcoSize < sizeof(Box_stco) || stszSize < sizeof(Box_stsz)) {
+        return 0;
+    }
+    uint64_t stscEntries = ntohl(stsc->entry_count);
+    uint64_t stcoEntries = ntohl(stco->entry_count);
+    uint64_t sampleSize = ntohl(stsz->sample_size);
+    uint64_t sampleCount = ntohl(stsz->sample_count);
+    uint64_t stszEntries = sampleSize ? 0 : sampleCount;
+    return sizeof(Box_stsc) + stscEntries * sizeof(Box_stsc_entry) <= stscSize &&
+           sizeof(Box_stco) + stcoEntries * sizeof(uint32_t) <= stcoSize &&
+           sizeof(Box_stsz) + stszEntries * sizeof(uint32_t) <= stszSize &&
+           sampleSize * sampleCount <= movieSize;
+}
+
 
 // Atom container header
 typedef struct __attribute__((packed)) _AtomContainer {
@@ -186,15 +248,23 @@ Container init_container_box(void *data)
     return container;
 }
 
-Container init_container_atom_container(AtomContainer *data)
+// The 'sean' atom follows the 12-byte atom container header and must end inside the
+// sample. Returns -1 if it doesn't.
+int init_container_atom_container(AtomContainer *data, uint32_t dataSize, Container *container)
 {
-    Container container;
-    container.boxHeader = read_box_header(&data->size);
-    container.boxStart = data;
-    container.boxData = &data->contents;
-    container.boxExtent = container.boxStart + container.boxHeader.size;
+    if (dataSize < sizeof(AtomContainer)) {
+        return -1;
+    }
+    container->boxHeader = read_box_header(&data->size);
+    container->boxStart = data;
+    container->boxData = &data->contents;
+    container->boxExtent = (void *) &data->size + container->boxHeader.size;
+    if (container->boxHeader.size < sizeof(AtomHeader) ||
+        container->boxHeader.size > dataSize - offsetof(AtomContainer, size)) {
+        return -1;
+    }
     
-    return container;
+    return 0;
 }
 
 static int sIndentLevel = 0;
@@ -205,66 +275,164 @@ void print_box(const Container *boxContainer)
     fprintf(stderr, "%*c%p: '%.4s' box (%d bytes)\n", sIndentLevel, ' ', boxContainer->boxStart, (char*) &fourcc, boxContainer->boxHeader.size );
 }
 
+// What the inspector reports for a known box type
+typedef enum {
+    kBoxPlain = 0,
+    kBoxFileType,
+    kBoxHandler,
+    kBoxSampleSize,
+    kBoxChunkOffset,
+    kBoxChunkOffset64,
+    kBoxSampleToChunk,
+    kBoxTimeToSample
+} BoxKind;
+
+typedef struct _BoxTypeInfo {
+    uint32_t  type;
+    uint8_t   isContainer;
+    uint8_t   kind;
+} BoxTypeInfo;
+
+// Known box types live in a table indexed by a multiplicative hash of the fourcc. The
+// multiplier was chosen so that none of the types below collide, which makes a lookup
+// one multiply, one shift and one compare.
+#define FOURCC_HASH_BITS        7
+#define FOURCC_HASH_MULTIPLIER  0x67BE9999u
+#define FOURCC_SLOT(t)          ((uint32_t)((uint32_t)(t) * FOURCC_HASH_MULTIPLIER) >> (32 - FOURCC_HASH_BITS))
+#define BOX_TYPE(t, container, kind)  [FOURCC_SLOT(t)] = { t, container, kind }
+
+static const BoxTypeInfo cBoxTypes[1 << FOURCC_HASH_BITS] = {
+    BOX_TYPE('moov', 1, kBoxPlain),
+    BOX_TYPE('trak', 1, kBoxPlain),
+    BOX_TYPE('edts', 1, kBoxPlain),
+    BOX_TYPE('mdia', 1, kBoxPlain),
+    BOX_TYPE('minf', 1, kBoxPlain),
+    BOX_TYPE('dinf', 1, kBoxPlain),
+    BOX_TYPE('stbl', 1, kBoxPlain),
+    BOX_TYPE('mvex', 1, kBoxPlain),
+    BOX_TYPE('moof', 1, kBoxPlain),
+    BOX_TYPE('traf', 1, kBoxPlain),
+    BOX_TYPE('mfra', 1, kBoxPlain),
+    BOX_TYPE('udta', 1, kBoxPlain),
+    BOX_TYPE('meta', 1, kBoxPlain),
+    BOX_TYPE('ipro', 1, kBoxPlain),
+    BOX_TYPE('sinf', 1, kBoxPlain),
+    BOX_TYPE('gmhd', 1, kBoxPlain),
+    BOX_TYPE('tref', 1, kBoxPlain),
+    BOX_TYPE('ftyp', 0, kBoxFileType),
+    BOX_TYPE('mdat', 0, kBoxPlain),
+    BOX_TYPE('free', 0, kBoxPlain),
+    BOX_TYPE('skip', 0, kBoxPlain),
+    BOX_TYPE('wide', 0, kBoxPlain),
+    BOX_TYPE('mvhd', 0, kBoxPlain),
+    BOX_TYPE('tkhd', 0, kBoxPlain),
+    BOX_TYPE('mdhd', 0, kBoxPlain),
+    BOX_TYPE('hdlr', 0, kBoxHandler),
+    BOX_TYPE('vmhd', 0, kBoxPlain),
+    BOX_TYPE('smhd', 0, kBoxPlain),
+    BOX_TYPE('dref', 0, kBoxPlain),
+    BOX_TYPE('stsd', 0, kBoxPlain),
+    BOX_TYPE('stts', 0, kBoxTimeToSample),
+    BOX_TYPE('stss', 0, kBoxPlain),
+    BOX_TYPE('stsc', 0, kBoxSampleToChunk),
+    BOX_TYPE('stsz', 0, kBoxSampleSize),
+    BOX_TYPE('stco', 0, kBoxChunkOffset),
+    BOX_TYPE('co64', 0, kBoxChunkOffset64),
+    BOX_TYPE('ctts', 0, kBoxPlain),
+    BOX_TYPE('elst', 0, kBoxPlain),
+    BOX_TYPE('iods', 0, kBoxPlain),
+    BOX_TYPE('cmov', 0, kBoxPlain)
+};
+
+// Returns NULL for unknown types
+const BoxTypeInfo *lookup_box_type(uint32_t type)
+{
+    const BoxTypeInfo *info = &cBoxTypes[FOURCC_SLOT(type)];
+    return (info->type == type && type != 0) ? info : NULL;
+}
+
 int is_type_container(uint32_t type)
 {
-    // List of box types known to be box containers
-    const uint32_t cContainerTypes[] = { 'moov', 'trak', 'edts', 'mdia', 'minf', 'dinf', 'stbl', 'mvex', 'moof', 'traf', 'mfra', 'udta', 'meta', 'ipro', 'sinf' };
-    const int cContainerTypesCount = sizeof(cContainerTypes) / sizeof(uint32_t);
+    const BoxTypeInfo *info = lookup_box_type(type);
+    return info && info->isContainer;
+}
 
-    for (int i = 0; i < cContainerTypesCount; i++) {
-        if (cContainerTypes[i] == type) {
-            return 1;
+// Reads the box at cursor inside a parent ending at extent. A size of 0 runs to the end
+// of the parent. Returns -1 if the header or the box doesn't fit.
+int init_child_box(void *cursor, void *extent, Container *box)
+{
+    if (cursor >= extent || (uint64_t)(extent - cursor) < sizeof(BoxHeader)) {
+        return -1;
+    }
+    uint64_t available = extent - cursor;
+    *box = init_container_box(cursor);
+    
+    uint64_t size = box->boxHeader.size;
+    uint32_t headerSize = sizeof(BoxHeader);
+    if (size == 1) {
+        // 64-bit size follows the type
+        if (available < sizeof(BoxHeader) + sizeof(uint64_t)) {
+            return -1;
         }
+        const uint32_t *largeSize = (const uint32_t *)(cursor + sizeof(BoxHeader));
+        size = ((uint64_t) ntohl(largeSize[0]) << 32) | ntohl(largeSize[1]);
+        headerSize += sizeof(uint64_t);
+        box->boxData += sizeof(uint64_t);
+    } else if (size == 0) {
+        size = available;
     }
+    
+    if (size < headerSize || size > available) {
+        return -1;
+    }
+    box->boxExtent = cursor + size;
     return 0;
 }
 
 // Pass 0 for boxType to enumerate all boxes
 typedef void (*EnumerateBoxesCallback)(Container box, int *stop, void *passthrough);
 
-void enumerate_boxes(const Container *container, uint32_t boxType, EnumerateBoxesCallback callback, void *passthrough) 
+// Returns -1 if a child doesn't fit inside the container. The boxes before it have been
+// visited; nothing after it can be trusted.
+int enumerate_boxes(const Container *container, uint32_t boxType, EnumerateBoxesCallback callback, void *passthrough) 
 {
     void *cursor = container->boxData;
     int stop = 0;
     
-    do {
-        Container box = init_container_box(cursor);
-        
-        if (box.boxHeader.size == 1) {
-            // Flag that box has 64-bit size. Unhandled.
-            fprintf(stderr, "Found a box with 64-bit size, which is unsupported.\n");
+    while (!stop && cursor < container->boxExtent) {
+        Container box;
+        if (init_child_box(cursor, container->boxExtent, &box) != 0) {
+            return -1;
         }
         
         if (!boxType || (box.boxHeader.type == boxType)) {
             callback(box, &stop, passthrough);
         }
-        
-        if (box.boxHeader.size > 0) {
-            cursor += box.boxHeader.size;
-        } else {
-            // Box extends to EOF
-            cursor = container->boxExtent;
-        }
-        
-    } while (!stop && cursor < container->boxExtent);
-}
-
-typedef struct _find_single_box_pass {
-    Container outBox;
-} find_single_box_pass;
-
-void find_single_box_callback(Container box, int *stop, void *passthrough)
-{
-    find_single_box_pass *out = (find_single_box_pass *)passthrough;
-    out->outBox = box;
-    *stop = 1;
+        cursor = box.boxExtent;
+    }
+    return 0;
 }
 
-Container find_single_box(const Container *container, uint32_t type)
+// boxStart is NULL when there is no such box. Sets *malformed if the boxes searched
+// didn't fit inside the container. This runs for every sample, so it walks the children
+// itself rather than through enumerate_boxes() and a callback.
+Container find_single_box(const Container *container, uint32_t type, int *malformed)
 {
-    find_single_box_pass result;
-    enumerate_boxes(container, type, &find_single_box_callback, &result);
-    return result.outBox;
+    Container box;
+    void *cursor = container->boxData;
+    
+    while (cursor < container->boxExtent) {
+        if (init_child_box(cursor, container->boxExtent, &box) != 0) {
+            *malformed = 1;
+            break;
+        }
+        if (box.boxHeader.type == type) {
+            return box;
+        }
+        cursor = box.boxExtent;
+    }
+    memset(&box, 0, sizeof(box));
+    return box;
 }
 
 
@@ -331,121 +499,2122 @@ void swap_pano_sample(QTVRPanoSampleAtom *pdatIn, QTVRPanoSampleAtom *pdatOut)
     return;
 }
 
-int update_pano_sample(void *panoSample, uint32_t size)
+#pragma mark Workspaces
+
+// Buffers at least this large may be backed by huge pages
+static const size_t cHugePageSize = 2 * 1024 * 1024;
+
+// Memory that only grows, keeping its contents when it does
+typedef struct _WorkspaceBuffer {
+    void *      data;
+    size_t      size;
+    int         mapped;     // anonymous mapping rather than malloc
+} WorkspaceBuffer;
+
+struct _QTVRFixWorkspace {
+    int                 hugePages;
+    WorkspaceBuffer     moov;           // movie atom read with pread
+    WorkspaceBuffer     tailWindow;     // end of the file, searched for the movie atom
+    WorkspaceBuffer     ranges;         // sample ranges of the current track
+    WorkspaceBuffer     sample;         // one sample read with pread
+    WorkspaceBuffer     patches;
+    WorkspaceBuffer     panoRecords;
+    WorkspaceBuffer     digest;         // chunk buffers of the threads hashing the movie
+    WorkspaceBuffer     digestHashes;   // hash of each of its chunks
+    WorkspaceBuffer     residency;      // page cache state of the movie before it was read
+    WorkspaceBuffer     residencyAfter;
+};
+
+// Allocates size bytes, from huge pages when asked and worth it. Returns NULL on failure.
+void *workspace_allocate(size_t *size, int hugePages, int *mapped)
+{
+    *mapped = 0;
+    if (hugePages && *size >= cHugePageSize) {
+        size_t mapSize = (*size + cHugePageSize - 1) & ~(cHugePageSize - 1);
+#if defined(MADV_HUGEPAGE)
+        void *data = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, mapSize, MADV_HUGEPAGE);
+        }
+#elif defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
+        void *data = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+#else
+        void *data = MAP_FAILED;
+#endif
+        if (data != MAP_FAILED) {
+            *size = mapSize;
+            *mapped = 1;
+            return data;
+        }
+    }
+    return malloc(*size);
+}
+
+void workspace_buffer_release(WorkspaceBuffer *buffer)
+{
+    if (buffer->mapped) {
+        munmap(buffer->data, buffer->size);
+    } else {
+        free(buffer->data);
+    }
+    memset(buffer, 0, sizeof(WorkspaceBuffer));
+}
+
+// Returns room for at least size bytes, or NULL with the buffer unchanged
+void *workspace_buffer_reserve(WorkspaceBuffer *buffer, size_t size, int hugePages)
 {
-    int didChange = 0;
+    if (size <= buffer->size) {
+        return buffer->data;
+    }
     
-    AtomContainer *atomContainer = (AtomContainer *)panoSample;
-    Container panoSampleContainer = init_container_atom_container(atomContainer);
+    // Grow by half again, so a slowly rising maximum doesn't copy every time
+    size_t capacity = buffer->size + buffer->size / 2;
+    if (capacity < size) {
+        capacity = size;
+    }
+    int mapped;
+    void *data = workspace_allocate(&capacity, hugePages, &mapped);
+    if (!data) {
+        return NULL;
+    }
+    if (buffer->size) {
+        memcpy(data, buffer->data, buffer->size);
+    }
+    workspace_buffer_release(buffer);
+    buffer->data = data;
+    buffer->size = capacity;
+    buffer->mapped = mapped;
+    return data;
+}
+
+void workspace_release(QTVRFixWorkspace *workspace)
+{
+    workspace_buffer_release(&workspace->moov);
+    workspace_buffer_release(&workspace->tailWindow);
+    workspace_buffer_release(&workspace->ranges);
+    workspace_buffer_release(&workspace->sample);
+    workspace_buffer_release(&workspace->patches);
+    workspace_buffer_release(&workspace->panoRecords);
+    workspace_buffer_release(&workspace->digest);
+    workspace_buffer_release(&workspace->digestHashes);
+    workspace_buffer_release(&workspace->residency);
+    workspace_buffer_release(&workspace->residencyAfter);
+}
+
+QTVRFixWorkspace *qtvrfix_workspace_create (int hugePages)
+{
+    QTVRFixWorkspace *workspace = calloc(1, sizeof(QTVRFixWorkspace));
+    if (workspace) {
+        workspace->hugePages = hugePages;
+    }
+    return workspace;
+}
+
+void qtvrfix_workspace_free (QTVRFixWorkspace *workspace)
+{
+    if (workspace) {
+        workspace_release(workspace);
+        free(workspace);
+    }
+}
+
+
+#pragma mark Patch Rules
+
+// The repair every run applies unless told otherwise: pano samples without hot spots
+// must not claim any hot spot frames, or QuickTime 7.6.9 and later crash on mouse-over.
+static const char *cBuiltInRules =
+    "pano sean/pdat if hotSpotSizeX==0 set hotSpotNumFramesX=0 hotSpotNumFramesY=0\n";
+
+#define MAX_ATOM_PATH_DEPTH     8
+#define MAX_RULE_TERMS          16
+
+typedef enum {
+    kFieldUnsigned = 0,
+    kFieldFloat
+} PatchFieldKind;
+
+// A big-endian field in an atom's data, addressed by byte offset
+typedef struct _PatchField {
+    uint32_t        offset;
+    uint8_t         width;      // 1, 2 or 4 bytes
+    uint8_t         kind;
+} PatchField;
+
+typedef enum {
+    kCompareEqual = 0,
+    kCompareNotEqual,
+    kCompareLess,
+    kCompareLessEqual,
+    kCompareGreater,
+    kCompareGreaterEqual
+} PatchCompare;
+
+typedef struct _PatchPredicate {
+    PatchField      field;
+    PatchCompare    compare;
+    uint32_t        value;
+} PatchPredicate;
+
+typedef struct _PatchAssignment {
+    PatchField      field;
+    uint32_t        value;
+} PatchAssignment;
+
+// Sets every assignment when all predicates hold
+typedef struct _PatchRule {
+    PatchPredicate  predicates[MAX_RULE_TERMS];
+    int             predicateCount;
+    PatchAssignment assignments[MAX_RULE_TERMS];
+    int             assignmentCount;
+} PatchRule;
+
+// Rules sharing one atom path, so the atom is located once for all of them
+typedef struct _PatchTarget {
+    uint32_t        path[MAX_ATOM_PATH_DEPTH];
+    int             pathDepth;
+    int             inSample;   // path starts at the pano sample's 'sean' atom container
+    PatchRule *     rules;
+    int             ruleCount;
+} PatchTarget;
+
+// Targets for tracks with one handler type
+typedef struct _PatchHandler {
+    uint32_t        handlerType;    // 0 matches every track
+    PatchTarget *   targets;
+    int             targetCount;
+} PatchHandler;
+
+struct _QTVRFixRuleSet {
+    PatchHandler *  handlers;
+    int             handlerCount;
+};
+
+// Field names understood for known atoms
+typedef struct _NamedField {
+    uint32_t        atomType;
+    const char *    name;
+    PatchField      field;
+} NamedField;
+
+#define PDAT_FIELD(name, kind) { 'pdat', #name, { offsetof(QTVRPanoSampleAtom, name), sizeof(((QTVRPanoSampleAtom *)0)->name), kind } }
+
+static const NamedField cNamedFields[] = {
+    PDAT_FIELD(majorVersion, kFieldUnsigned),
+    PDAT_FIELD(minorVersion, kFieldUnsigned),
+    PDAT_FIELD(imageRefTrackIndex, kFieldUnsigned),
+    PDAT_FIELD(hotSpotRefTrackIndex, kFieldUnsigned),
+    PDAT_FIELD(minPan, kFieldFloat),
+    PDAT_FIELD(maxPan, kFieldFloat),
+    PDAT_FIELD(minTilt, kFieldFloat),
+    PDAT_FIELD(maxTilt, kFieldFloat),
+    PDAT_FIELD(minFieldOfView, kFieldFloat),
+    PDAT_FIELD(maxFieldOfView, kFieldFloat),
+    PDAT_FIELD(defaultPan, kFieldFloat),
+    PDAT_FIELD(defaultTilt, kFieldFloat),
+    PDAT_FIELD(defaultFieldOfView, kFieldFloat),
+    PDAT_FIELD(imageSizeX, kFieldUnsigned),
+    PDAT_FIELD(imageSizeY, kFieldUnsigned),
+    PDAT_FIELD(imageNumFramesX, kFieldUnsigned),
+    PDAT_FIELD(imageNumFramesY, kFieldUnsigned),
+    PDAT_FIELD(hotSpotSizeX, kFieldUnsigned),
+    PDAT_FIELD(hotSpotSizeY, kFieldUnsigned),
+    PDAT_FIELD(hotSpotNumFramesX, kFieldUnsigned),
+    PDAT_FIELD(hotSpotNumFramesY, kFieldUnsigned),
+    PDAT_FIELD(flags, kFieldUnsigned),
+    PDAT_FIELD(panoType, kFieldUnsigned),
+    PDAT_FIELD(reserved, kFieldUnsigned)
+};
+
+uint32_t read_field(const uint8_t *data, const PatchField *field)
+{
+    switch (field->width) {
+        case 1:  return data[field->offset];
+        case 2:  return ((uint32_t) data[field->offset] << 8) | data[field->offset+1];
+        default: return ((uint32_t) data[field->offset] << 24) | ((uint32_t) data[field->offset+1] << 16) |
+                        ((uint32_t) data[field->offset+2] << 8) | data[field->offset+3];
+    }
+}
+
+void write_field(uint8_t *data, const PatchField *field, uint32_t value)
+{
+    for (int i = field->width - 1; i >= 0; i--) {
+        data[field->offset + i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+float field_bits_to_float(uint32_t bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(float));
+    return value;
+}
+
+int evaluate_predicate(const PatchPredicate *predicate, const uint8_t *data)
+{
+    uint32_t raw = read_field(data, &predicate->field);
+    int order;
     
-    Container pdatAtom = find_single_box(&panoSampleContainer, 'pdat');
-    QTVRPanoSampleAtom *pdat = (QTVRPanoSampleAtom *) pdatAtom.childAtomData;
-        
-    QTVRPanoSampleAtom pdatNative;
-    swap_pano_sample(pdat, &pdatNative);
+    if (predicate->field.kind == kFieldFloat) {
+        float a = field_bits_to_float(raw), b = field_bits_to_float(predicate->value);
+        order = (a < b) ? -1 : (a > b) ? 1 : 0;
+    } else {
+        order = (raw < predicate->value) ? -1 : (raw > predicate->value) ? 1 : 0;
+    }
     
-    // This is the actual fix
-    if (pdatNative.hotSpotSizeX == 0) {
-        // no hotspots. Num frames should be 0
-        didChange = !!(pdatNative.hotSpotNumFramesX + pdatNative.hotSpotNumFramesY);
+    switch (predicate->compare) {
+        case kCompareEqual:         return order == 0;
+        case kCompareNotEqual:      return order != 0;
+        case kCompareLess:          return order < 0;
+        case kCompareLessEqual:     return order <= 0;
+        case kCompareGreater:       return order > 0;
+        case kCompareGreaterEqual:  return order >= 0;
+    }
+    return 0;
+}
 
-        pdatNative.hotSpotNumFramesX = 0;
-        pdatNative.hotSpotNumFramesY = 0;
+// Growable list of the fields changed in one movie
+typedef struct _PatchLog {
+    int                 enabled;
+    WorkspaceBuffer *   buffer;
+    uint32_t            count;
+} PatchLog;
 
-        swap_pano_sample(&pdatNative, pdat);
+void patch_log_add(PatchLog *log, off_t offset, const PatchField *field, const uint8_t *oldBytes, uint32_t newValue)
+{
+    if (!log->enabled) {
+        return;
+    }
+    QTVRFixPatch *patches = workspace_buffer_reserve(log->buffer, (log->count + 1) * sizeof(QTVRFixPatch), 0);
+    if (!patches) {
+        return;
     }
     
-    return didChange;
+    QTVRFixPatch *patch = &patches[log->count++];
+    memset(patch, 0, sizeof(QTVRFixPatch));
+    patch->offset = offset + field->offset;
+    patch->length = field->width;
+    memcpy(patch->oldBytes, oldBytes + field->offset, field->width);
+    write_field(patch->newBytes, &(PatchField){ 0, field->width, field->kind }, newValue);
 }
 
-void enumerate_track_callback(Container trakBox, int *stop, void *passthrough)
+#define MAX_DIRTY_RANGES        16
+
+// Bytes changed in one atom or sample, so a copy read with pread can be written back
+// without the bytes around them. Once the list is full the last range grows instead.
+typedef struct _DirtyRanges {
+    uint32_t    count;
+    struct {
+        off_t       offset;             // in the movie
+        uint32_t    length;
+    } ranges[MAX_DIRTY_RANGES];
+} DirtyRanges;
+
+void dirty_ranges_add(DirtyRanges *dirty, off_t offset, uint32_t length)
+{
+    if (dirty->count > 0) {
+        off_t lastStart = dirty->ranges[dirty->count - 1].offset;
+        off_t lastEnd = lastStart + dirty->ranges[dirty->count - 1].length;
+        if (dirty->count == MAX_DIRTY_RANGES || (offset <= lastEnd && offset + (off_t) length >= lastStart)) {
+            off_t start = (offset < lastStart) ? offset : lastStart;
+            off_t end = (offset + (off_t) length > lastEnd) ? offset + length : lastEnd;
+            dirty->ranges[dirty->count - 1].offset = start;
+            dirty->ranges[dirty->count - 1].length = (uint32_t)(end - start);
+            return;
+        }
+    }
+    dirty->ranges[dirty->count].offset = offset;
+    dirty->ranges[dirty->count].length = length;
+    dirty->count++;
+}
+
+// Growable list of the pano samples seen in one movie
+typedef struct _PanoCatalog {
+    int                 enabled;
+    WorkspaceBuffer *   buffer;
+    uint32_t            count;
+} PanoCatalog;
+
+void pano_catalog_add(PanoCatalog *catalog, uint32_t track, uint32_t sample, const uint8_t *pdat)
 {
-    Container mdiaBox = find_single_box(&trakBox, 'mdia');
-    Container hdlrBox = find_single_box(&mdiaBox, 'hdlr');
-    void *movieData = passthrough;
+    QTVRFixPanoRecord *records = workspace_buffer_reserve(catalog->buffer, (catalog->count + 1) * sizeof(QTVRFixPanoRecord), 0);
+    if (!records) {
+        return;
+    }
     
-    Box_hdlr *hdlr = (Box_hdlr *) hdlrBox.boxStart;
+    QTVRFixPanoRecord *record = &records[catalog->count++];
+    record->track = track;
+    record->sample = sample;
+    memcpy(record->pdat, pdat, QTVRFIX_PDAT_SIZE);
+}
+
+// Applies every rule of a target to the located atom data, which sits at dataOffset in the
+// movie. Returns the number of fields changed, and adds their bytes to dirty.
+int apply_patch_target(const PatchTarget *target, uint8_t *data, uint32_t dataSize, PatchLog *log, DirtyRanges *dirty, off_t dataOffset)
+{
+    int changedFields = 0;
     
-    if (hdlr->handler_type == ntohl('pano')) {
-        *stop = 1;
-        
-        Container minfBox = find_single_box(&mdiaBox, 'minf');
-        Container stblBox = find_single_box(&minfBox, 'stbl');
-        Container stscBox = find_single_box(&stblBox, 'stsc');
-        Container stcoBox = find_single_box(&stblBox, 'stco');
-        Container stszBox = find_single_box(&stblBox, 'stsz');
-        
-        Box_stsc *stsc = (Box_stsc *) stscBox.boxStart;
-        Box_stco *stco = (Box_stco *) stcoBox.boxStart;
-        Box_stsz *stsz = (Box_stsz *) stszBox.boxStart;
+    for (int r = 0; r < target->ruleCount; r++) {
+        const PatchRule *rule = &target->rules[r];
+        int matches = 1;
         
-        uint32_t sampleCount = ntohl(stsz->sample_count);
-        uint32_t sampleSize = ntohl(stsz->sample_size);
-        uint32_t lastPanoSampleChunk = 0;
-        uint32_t cumuChunkOffset = 0;
-        int updatedSamples = 0;
+        for (int p = 0; p < rule->predicateCount && matches; p++) {
+            const PatchField *field = &rule->predicates[p].field;
+            matches = ((uint64_t) field->offset + field->width <= dataSize) && evaluate_predicate(&rule->predicates[p], data);
+        }
+        if (!matches) {
+            continue;
+        }
         
-        for (int sampleIndex = 1; sampleIndex <= sampleCount; sampleIndex++) {
-            uint32_t panoSampleSize = sampleSize;
-            uint32_t panoSampleOffset = 0;
-            uint32_t panoSampleChunk = stsc_sample_to_chunk(stsc, sampleIndex);
-            
-            if (sampleSize == 0) {
-                panoSampleSize = ntohl(stsz->entry_size[sampleIndex-1]);
+        for (int a = 0; a < rule->assignmentCount; a++) {
+            const PatchAssignment *assignment = &rule->assignments[a];
+            if ((uint64_t) assignment->field.offset + assignment->field.width > dataSize) {
+                continue;
             }
-            
-            if (panoSampleChunk != lastPanoSampleChunk) {
-                cumuChunkOffset = 0;
-                lastPanoSampleChunk = panoSampleChunk;
+            if (read_field(data, &assignment->field) != assignment->value) {
+                patch_log_add(log, dataOffset, &assignment->field, data, assignment->value);
+                write_field(data, &assignment->field, assignment->value);
+                dirty_ranges_add(dirty, dataOffset + assignment->field.offset, assignment->field.width);
+                changedFields++;
             }
-            
-            panoSampleOffset = stco_chunk_offset(stco, panoSampleChunk) + cumuChunkOffset;
-            cumuChunkOffset += panoSampleSize;
-            
-            void *panoSample = movieData + panoSampleOffset;
-            updatedSamples += update_pano_sample(panoSample, panoSampleSize);
         }
     }
+    
+    return changedFields;
 }
 
-int qtvrfix (const char *moviePath)
+// Parses a single field reference: a known name for the atom, or u8@N, u16@N, u32@N, f32@N.
+// The field must fit in 32-bit offsets, and inside the atom when its size is known ('pdat').
+int parse_patch_field(const char *text, size_t length, uint32_t atomType, PatchField *field)
 {
-    int fd = open(moviePath, O_RDWR);
-    if (fd != -1) {
-        // get file size
-        struct stat fs;
-        fstat(fd, &fs);
-        const off_t MAX_SIZE = 1024 * 1024 * 1024;
-        
-        if (fs.st_size > MAX_SIZE) {
-            fprintf(stderr, "File %s is larger than allowed (%lld bytes > %lld)\n", moviePath, fs.st_size, MAX_SIZE);
-            return -2;
+    for (int i = 0; i < sizeof(cNamedFields) / sizeof(NamedField); i++) {
+        if (cNamedFields[i].atomType == atomType && strlen(cNamedFields[i].name) == length &&
+            strncmp(cNamedFields[i].name, text, length) == 0) {
+            *field = cNamedFields[i].field;
+            return 0;
         }
+    }
+    
+    // Digits only, so "-1" or " 1" can't slip through the way they do with %u
+    char kind;
+    unsigned bits;
+    int consumed = 0;
+    if (sscanf(text, "%c%u@%n", &kind, &bits, &consumed) != 2 || consumed == 0 || consumed >= length ||
+        !((kind == 'u' && (bits == 8 || bits == 16 || bits == 32)) || (kind == 'f' && bits == 32))) {
+        return -1;
+    }
+    uint64_t offset = 0;
+    for (size_t i = consumed; i < length; i++) {
+        if (text[i] < '0' || text[i] > '9' || (offset = offset * 10 + (text[i] - '0')) > UINT32_MAX) {
+            return -1;
+        }
+    }
+    uint64_t limit = (atomType == 'pdat') ? QTVRFIX_PDAT_SIZE : UINT32_MAX;
+    if (offset + bits / 8 > limit) {
+        return -1;
+    }
+    
+    field->offset = (uint32_t) offset;
+    field->width = bits / 8;
+    field->kind = (kind == 'f') ? kFieldFloat : kFieldUnsigned;
+    return 0;
+}
 
-        // map file to memory
-        void *movieData = mmap(0, fs.st_size, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, fd, 0);
-        if (!movieData) {
-            fprintf(stderr, "Failed to map file %s", moviePath);
-            return -3;
+// Parses a number, a float (for float fields) or a 'fourcc', which must fit the field
+int parse_patch_value(const char *text, const PatchField *field, uint32_t *value)
+{
+    char *end;
+    
+    if (text[0] == '\'' && strlen(text) == 6 && text[5] == '\'') {
+        *value = ((uint32_t)(uint8_t) text[1] << 24) | ((uint32_t)(uint8_t) text[2] << 16) |
+                 ((uint32_t)(uint8_t) text[3] << 8) | (uint8_t) text[4];
+        return (field->width == 4) ? 0 : -1;
+    }
+    if (field->kind == kFieldFloat) {
+        float number = strtof(text, &end);
+        memcpy(value, &number, sizeof(float));
+        return (*text && !*end) ? 0 : -1;
+    }
+    
+    // strtoull accepts a sign and wraps negative numbers around, so refuse one here
+    if (!isdigit((unsigned char) text[0])) {
+        return -1;
+    }
+    errno = 0;
+    unsigned long long number = strtoull(text, &end, 0);
+    if (*end || errno == ERANGE || number > (UINT32_MAX >> (32 - 8 * field->width))) {
+        return -1;
+    }
+    *value = (uint32_t) number;
+    return 0;
+}
+
+uint32_t parse_fourcc(const char *text, size_t length, int *ok)
+{
+    *ok = (length == 4);
+    return *ok ? ((uint32_t)(uint8_t) text[0] << 24) | ((uint32_t)(uint8_t) text[1] << 16) |
+                 ((uint32_t)(uint8_t) text[2] << 8) | (uint8_t) text[3] : 0;
+}
+
+// Files a parsed rule under its handler and path, creating them as needed
+void add_patch_rule(QTVRFixRuleSet *rules, uint32_t handlerType, const uint32_t *path, int pathDepth, const PatchRule *rule)
+{
+    PatchHandler *handler = NULL;
+    for (int i = 0; i < rules->handlerCount; i++) {
+        if (rules->handlers[i].handlerType == handlerType) {
+            handler = &rules->handlers[i];
+        }
+    }
+    if (!handler) {
+        rules->handlers = realloc(rules->handlers, (rules->handlerCount + 1) * sizeof(PatchHandler));
+        handler = &rules->handlers[rules->handlerCount++];
+        memset(handler, 0, sizeof(PatchHandler));
+        handler->handlerType = handlerType;
+    }
+    
+    PatchTarget *target = NULL;
+    for (int i = 0; i < handler->targetCount; i++) {
+        if (handler->targets[i].pathDepth == pathDepth && memcmp(handler->targets[i].path, path, pathDepth * sizeof(uint32_t)) == 0) {
+            target = &handler->targets[i];
         }
+    }
+    if (!target) {
+        handler->targets = realloc(handler->targets, (handler->targetCount + 1) * sizeof(PatchTarget));
+        target = &handler->targets[handler->targetCount++];
+        memset(target, 0, sizeof(PatchTarget));
+        memcpy(target->path, path, pathDepth * sizeof(uint32_t));
+        target->pathDepth = pathDepth;
+        target->inSample = (path[0] == 'sean');
+    }
+    
+    target->rules = realloc(target->rules, (target->ruleCount + 1) * sizeof(PatchRule));
+    target->rules[target->ruleCount++] = *rule;
+}
 
-        Container movieContainer = init_container(movieData, movieData + fs.st_size);
-        
-        // print_container_r(&movieContainer);
-        Container moovBox = find_single_box(&movieContainer, 'moov');
-        enumerate_boxes(&moovBox, ('trak'), enumerate_track_callback, movieData);
+// Compiles one line: HANDLER PATH [if FIELD<op>VALUE ...] set FIELD=VALUE ...
+int compile_patch_rule(QTVRFixRuleSet *rules, char *line, char *error, size_t errorSize)
+{
+    char *saveptr = NULL;
+    char *token = strtok_r(line, " \t\r\n", &saveptr);
+    if (!token || token[0] == '#') {
+        return 0;
+    }
+    
+    int ok;
+    uint32_t handlerType = (strcmp(token, "*") == 0) ? (ok = 1, 0) : parse_fourcc(token, strlen(token), &ok);
+    if (!ok) {
+        snprintf(error, errorSize, "handler type '%s' must be four characters or '*'", token);
+        return -1;
+    }
+    
+    token = strtok_r(NULL, " \t\r\n", &saveptr);
+    uint32_t path[MAX_ATOM_PATH_DEPTH];
+    int pathDepth = 0;
+    for (char *element = token; element && *element; ) {
+        size_t length = strcspn(element, "/");
+        if (pathDepth == MAX_ATOM_PATH_DEPTH || !(path[pathDepth++] = parse_fourcc(element, length, &ok), ok)) {
+            snprintf(error, errorSize, "bad atom path '%s'", token);
+            return -1;
+        }
+        element += length + (element[length] == '/');
+    }
+    if (pathDepth == 0) {
+        snprintf(error, errorSize, "missing atom path");
+        return -1;
+    }
+    uint32_t atomType = path[pathDepth-1];
+    
+    PatchRule rule;
+    memset(&rule, 0, sizeof(PatchRule));
+    int inAssignments = 0;
+    
+    while ((token = strtok_r(NULL, " \t\r\n", &saveptr))) {
+        if (strcmp(token, "if") == 0 || strcmp(token, "and") == 0) {
+            continue;
+        }
+        if (strcmp(token, "set") == 0) {
+            inAssignments = 1;
+            continue;
+        }
         
-        int result = msync(movieData, fs.st_size, MS_SYNC);
-        if (result == -1) {
-            fprintf(stderr, "Error writing file: %d\n", errno);
+        size_t nameLength = strcspn(token, "=!<>");
+        const char *op = token + nameLength;
+        PatchField field;
+        if (!*op || parse_patch_field(token, nameLength, atomType, &field)) {
+            snprintf(error, errorSize, "bad field in '%s'", token);
+            return -1;
         }
-        munmap(movieData, fs.st_size);
-        close(fd);
         
-        return 0;
-    } else {
-        printf("File not found: %s", moviePath);
+        if (inAssignments) {
+            if (op[0] != '=' || rule.assignmentCount == MAX_RULE_TERMS ||
+                parse_patch_value(op + 1, &field, &rule.assignments[rule.assignmentCount].value)) {
+                snprintf(error, errorSize, "bad assignment '%s'", token);
+                return -1;
+            }
+            rule.assignments[rule.assignmentCount++].field = field;
+        } else {
+            static const struct { const char *text; PatchCompare compare; } cOperators[] = {
+                { "==", kCompareEqual }, { "!=", kCompareNotEqual }, { "<=", kCompareLessEqual },
+                { ">=", kCompareGreaterEqual }, { "<", kCompareLess }, { ">", kCompareGreater }
+            };
+            int found = 0;
+            for (int i = 0; i < sizeof(cOperators) / sizeof(cOperators[0]) && !found; i++) {
+                size_t opLength = strlen(cOperators[i].text);
+                if (strncmp(op, cOperators[i].text, opLength) == 0 && rule.predicateCount < MAX_RULE_TERMS &&
+                    parse_patch_value(op + opLength, &field, &rule.predicates[rule.predicateCount].value) == 0) {
+                    rule.predicates[rule.predicateCount].compare = cOperators[i].compare;
+                    rule.predicates[rule.predicateCount++].field = field;
+                    found = 1;
+                }
+            }
+            if (!found) {
+                snprintf(error, errorSize, "bad condition '%s'", token);
+                return -1;
+            }
+        }
+    }
+    
+    if (rule.assignmentCount == 0) {
+        snprintf(error, errorSize, "rule has nothing to set");
         return -1;
     }
+    
+    add_patch_rule(rules, handlerType, path, pathDepth, &rule);
+    return 0;
+}
+
+int compile_patch_rules(QTVRFixRuleSet *rules, const char *text, char *error, size_t errorSize)
+{
+    char *copy = strdup(text);
+    int lineNumber = 0;
+    int status = 0;
+    
+    // strtok_r on lines would skip blank ones and miscount, so split by hand
+    for (char *line = copy; line && status == 0; ) {
+        char *next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        lineNumber++;
+        
+        char lineError[200];
+        if (compile_patch_rule(rules, line, lineError, sizeof(lineError))) {
+            snprintf(error, errorSize, "line %d: %s", lineNumber, lineError);
+            status = -1;
+        }
+        line = next;
+    }
+    
+    free(copy);
+    return status;
+}
+
+QTVRFixRuleSet *qtvrfix_rules_create (const char *text, int includeBuiltIn, char *error, size_t errorSize)
+{
+    QTVRFixRuleSet *rules = calloc(1, sizeof(QTVRFixRuleSet));
+    
+    if ((includeBuiltIn && compile_patch_rules(rules, cBuiltInRules, error, errorSize)) ||
+        (text && compile_patch_rules(rules, text, error, errorSize))) {
+        qtvrfix_rules_free(rules);
+        return NULL;
+    }
+    return rules;
 }
 
+void qtvrfix_rules_free (QTVRFixRuleSet *rules)
+{
+    if (!rules) {
+        return;
+    }
+    for (int h = 0; h < rules->handlerCount; h++) {
+        for (int t = 0; t < rules->handlers[h].targetCount; t++) {
+            free(rules->handlers[h].targets[t].rules);
+        }
+        free(rules->handlers[h].targets);
+    }
+    free(rules->handlers);
+    free(rules);
+}
+
+static QTVRFixRuleSet *sBuiltInRules = NULL;
+
+void create_built_in_rules(void)
+{
+    char error[200];
+    sBuiltInRules = qtvrfix_rules_create(NULL, 1, error, sizeof(error));
+}
+
+const QTVRFixRuleSet *built_in_rules(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, create_built_in_rules);
+    return sBuiltInRules;
+}
+
+// Follows an atom path below a container, returning the data of the last atom. Sets
+// *malformed if an atom on the way doesn't fit inside its parent.
+void *find_atom_path(const Container *container, const uint32_t *path, int pathDepth, int qtAtoms, uint32_t *dataSize, int *malformed)
+{
+    Container atom = *container;
+    
+    for (int i = 0; i < pathDepth; i++) {
+        Container child = find_single_box(&atom, path[i], malformed);
+        if (!child.boxStart || child.boxHeader.type != path[i]) {
+            return NULL;
+        }
+        if (qtAtoms) {
+            // QT atoms have a 20-byte header; their children and data follow it
+            if (child.childAtomData > child.boxExtent) {
+                *malformed = 1;
+                return NULL;
+            }
+            child.boxData = child.childAtomData;
+        }
+        atom = child;
+    }
+    
+    *dataSize = (atom.boxExtent > atom.boxData) ? (uint32_t)(atom.boxExtent - atom.boxData) : 0;
+    return atom.boxData;
+}
+
+
+#pragma mark Movie File I/O
+
+// Largest file that will be mapped in one piece
+static const off_t cMaxMappedSize = 1024 * 1024 * 1024;
+// Files up to this size are always mapped when on local storage
+static const off_t cSmallFileSize = 16 * 1024 * 1024;
+// Sanity limit on the movie atom loaded into memory for pread
+static const uint64_t cMaxMovieAtomSize = 256 * 1024 * 1024;
+
+// An open movie and the strategy used to reach its bytes. The movie may start
+// part way into the file (an archive member); all offsets are relative to base.
+typedef struct _MovieFile {
+    int         fd;
+    int         readFd;             // fd, or an O_DIRECT descriptor of the same file for uncached reads
+    off_t       base;
+    off_t       size;
+    void *      mapping;            // whole movie when using mmap, else NULL
+    void *      mapStart;           // page-aligned start of the mapping, at file offset mapOffset
+    off_t       mapOffset;
+    size_t      mapLength;
+    QTVRFixWorkspace *workspace;    // holds the sample read with pread
+    int         wroteData;
+} MovieFile;
+
+// Maps the movie's pages. The mapping starts on the page holding base.
+int movie_file_map(MovieFile *movie)
+{
+    const off_t pageSize = sysconf(_SC_PAGESIZE);
+    movie->mapOffset = movie->base & ~(pageSize - 1);
+    movie->mapLength = movie->size + (movie->base - movie->mapOffset);
+    movie->mapStart = mmap(0, movie->mapLength, PROT_READ | PROT_WRITE, MAP_FILE | MAP_SHARED, movie->fd, movie->mapOffset);
+    if (movie->mapStart == MAP_FAILED) {
+        movie->mapStart = NULL;
+        return -1;
+    }
+    movie->mapping = movie->mapStart + (movie->base - movie->mapOffset);
+    return 0;
+}
+
+// Address of an absolute, page-aligned file offset inside the mapping
+static inline void *movie_file_page(const MovieFile *movie, off_t fileOffset)
+{
+    return movie->mapStart + (fileOffset - movie->mapOffset);
+}
+
+// Returns a descriptor for reads that bypass the page cache, or fd itself. O_DIRECT needs
+// a descriptor of its own, as the writes through fd aren't aligned; F_NOCACHE can be set
+// on fd.
+int open_uncached_reader(int fd)
+{
+#if defined(O_DIRECT)
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    int directFd = open(path, O_RDONLY | O_DIRECT);
+    return (directFd != -1) ? directFd : fd;
+#else
+#if defined(F_NOCACHE)
+    fcntl(fd, F_NOCACHE, 1);
+#endif
+    return fd;
+#endif
+}
+
+// Reads size bytes at offset into buffer, returning where they start. Direct reads are
+// widened to whole pages, so the data sits part way into an aligned block.
+void *movie_file_read(MovieFile *movie, WorkspaceBuffer *buffer, off_t offset, size_t size)
+{
+    int hugePages = movie->workspace->hugePages;
+    off_t start = movie->base + offset;
+    
+    if (movie->readFd == movie->fd) {
+        void *data = workspace_buffer_reserve(buffer, size, hugePages);
+        if (!data || pread(movie->fd, data, size, start) != (ssize_t) size) {
+            return NULL;
+        }
+        return data;
+    }
+    
+    const off_t pageSize = sysconf(_SC_PAGESIZE);
+    off_t alignedStart = start & ~(pageSize - 1);
+    size_t alignedLength = (start + size - alignedStart + pageSize - 1) & ~(pageSize - 1);
+    uint8_t *data = workspace_buffer_reserve(buffer, alignedLength + pageSize, hugePages);
+    if (!data) {
+        return NULL;
+    }
+    uint8_t *aligned = (uint8_t *)(((uintptr_t) data + pageSize - 1) & ~(uintptr_t)(pageSize - 1));
+    // Comes up short at the end of the file
+    ssize_t count = pread(movie->readFd, aligned, alignedLength, alignedStart);
+    if (count < (ssize_t)(start - alignedStart + size)) {
+        return NULL;
+    }
+    return aligned + (start - alignedStart);
+}
+
+// Returns a pointer to size bytes at offset, or NULL if they can't be read
+void *movie_file_load(MovieFile *movie, off_t offset, uint32_t size)
+{
+    if (offset < 0 || offset + (off_t) size > movie->size) {
+        return NULL;
+    }
+    if (movie->mapping) {
+        return movie->mapping + offset;
+    }
+    return movie_file_read(movie, &movie->workspace->sample, offset, size);
+}
+
+// Writes back the changed bytes of data, which was read from offset. Only the dirty
+// ranges are written, so the rest of the atom or sample is left as it is on disk.
+// Mapped data is already in place.
+int movie_file_store(MovieFile *movie, off_t offset, const void *data, const DirtyRanges *dirty)
+{
+    if (movie->mapping) {
+        return 0;
+    }
+    
+    movie->wroteData = 1;
+    for (uint32_t i = 0; i < dirty->count; i++) {
+        const uint8_t *bytes = (const uint8_t *) data + (dirty->ranges[i].offset - offset);
+        if (pwrite(movie->fd, bytes, dirty->ranges[i].length, movie->base + dirty->ranges[i].offset) != (ssize_t) dirty->ranges[i].length) {
+            fprintf(stderr, "Error writing file: %d\n", errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Size of the read used to look for a movie atom at the end of the file
+static const off_t cTailWindowSize = 64 * 1024;
+
+int is_type_padding(uint32_t type)
+{
+    return type == 'free' || type == 'skip' || type == 'wide';
+}
+
+// Known first children of a movie atom, used to sanity-check a 'moov' found from the tail
+int is_type_movie_child(uint32_t type)
+{
+    const uint32_t cMovieChildTypes[] = { 'mvhd', 'cmov', 'trak', 'udta', 'iods', 'meta', 'prfl', 'clip', 'ctab', 'free', 'skip', 'wide' };
+    const int cMovieChildTypesCount = sizeof(cMovieChildTypes) / sizeof(uint32_t);
+    
+    for (int i = 0; i < cMovieChildTypesCount; i++) {
+        if (cMovieChildTypes[i] == type) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Finds the outermost moov or padding box in window that ends exactly at end.
+// Returns its offset within the window, or -1.
+off_t find_trailing_box(const uint8_t *window, off_t end, int isEOF, uint32_t *outType, uint64_t *outSize, uint32_t *outHeaderSize)
+{
+    for (off_t p = 0; p + (off_t) sizeof(BoxHeader) <= end; p++) {
+        BoxHeader header = read_box_header((void *)(window + p));
+        if (header.type != 'moov' && !is_type_padding(header.type)) {
+            continue;
+        }
+        
+        uint64_t size = header.size;
+        uint32_t headerSize = sizeof(BoxHeader);
+        if (size == 1) {
+            if (p + 16 > end) {
+                continue;
+            }
+            const uint32_t *largeSize = (const uint32_t *)(window + p + 8);
+            size = ((uint64_t) ntohl(largeSize[0]) << 32) | ntohl(largeSize[1]);
+            headerSize = 16;
+        } else if (size == 0 && isEOF) {
+            size = end - p;
+        }
+        
+        if (size >= headerSize && size == (uint64_t)(end - p)) {
+            *outType = header.type;
+            *outSize = size;
+            *outHeaderSize = headerSize;
+            return p;
+        }
+    }
+    return -1;
+}
+
+// Reads the last cTailWindowSize bytes and peels off trailing padding boxes looking for 'moov'.
+// Returns 1 if found; *needsConfirm is set when the match doesn't look like a movie atom.
+int locate_moov_tail(int fd, off_t base, off_t fileSize, off_t *moovOffset, uint64_t *moovSize, int *needsConfirm, QTVRFixWorkspace *workspace)
+{
+    off_t windowSize = fileSize < cTailWindowSize ? fileSize : cTailWindowSize;
+    off_t windowStart = fileSize - windowSize;
+    uint8_t *window = workspace_buffer_reserve(&workspace->tailWindow, windowSize, 0);
+    int found = 0;
+    
+    if (window && pread(fd, window, windowSize, base + windowStart) == (ssize_t) windowSize) {
+        off_t end = windowSize;
+        
+        while (end > 0) {
+            uint32_t type, headerSize;
+            uint64_t size;
+            off_t p = find_trailing_box(window, end, end == windowSize, &type, &size, &headerSize);
+            if (p < 0) {
+                break;
+            }
+            
+            if (type == 'moov') {
+                *moovOffset = windowStart + p;
+                *moovSize = size;
+                
+                // The first child should be a plausible movie atom child
+                BoxHeader child = { 0, 0 };
+                off_t childOffset = p + headerSize;
+                if (childOffset + (off_t) sizeof(BoxHeader) <= end) {
+                    child = read_box_header(window + childOffset);
+                }
+                *needsConfirm = !(is_type_movie_child(child.type) && child.size >= sizeof(BoxHeader) && child.size <= size);
+                found = 1;
+                break;
+            }
+            end = p;
+        }
+    }
+    
+    return found;
+}
+
+// Finds the 'moov' box. Top-level headers are walked with small reads from the start,
+// but before hopping over a box larger than the tail window the end of the file is
+// checked, which finds a trailing movie atom with a single read. The movie starts at
+// base in the file, and the offset returned is relative to it.
+int locate_moov(int fd, off_t base, off_t fileSize, off_t *moovOffset, uint64_t *moovSize, QTVRFixMoovLocator *locator, QTVRFixWorkspace *workspace)
+{
+    off_t cursor = 0;
+    int triedTail = 0;
+    int confirming = 0;
+    off_t tailOffset = 0;
+    uint64_t tailSize = 0;
+    
+    while (cursor + (off_t) sizeof(BoxHeader) <= fileSize) {
+        uint32_t header[4];
+        ssize_t headerBytes = pread(fd, header, sizeof(header), base + cursor);
+        if (headerBytes < (ssize_t) sizeof(BoxHeader)) {
+            break;
+        }
+        
+        uint64_t size = ntohl(header[0]);
+        uint32_t type = ntohl(header[1]);
+        if (size == 1) {
+            // 64-bit size follows the type
+            if (headerBytes < (ssize_t) sizeof(header)) {
+                break;
+            }
+            size = ((uint64_t) ntohl(header[2]) << 32) | ntohl(header[3]);
+        } else if (size == 0) {
+            // Box extends to EOF
+            size = fileSize - cursor;
+        }
+        if (size < sizeof(BoxHeader) || (off_t) size > fileSize - cursor) {
+            break;
+        }
+        
+        if (type == 'moov') {
+            *moovOffset = cursor;
+            *moovSize = size;
+            *locator = (confirming && cursor == tailOffset && size == tailSize) ? kQTVRFixMoovTailConfirmed : kQTVRFixMoovForward;
+            return 1;
+        }
+        
+        if (!triedTail && (off_t) size > cTailWindowSize) {
+            triedTail = 1;
+            if (locate_moov_tail(fd, base, fileSize, &tailOffset, &tailSize, &confirming, workspace)) {
+                if (!confirming) {
+                    *moovOffset = tailOffset;
+                    *moovSize = tailSize;
+                    *locator = kQTVRFixMoovTail;
+                    return 1;
+                }
+            }
+        }
+        cursor += size;
+    }
+    
+    return 0;
+}
+
+// Locks or unlocks the movie's byte range. Open file description locks belong to the
+// descriptor, so the workers sharing an archive's descriptor don't conflict with each
+// other, and a descriptor closed elsewhere in the process can't drop them. Classic
+// process-wide record locks stand in where they don't exist. flock() can't lock just
+// an archive member, so it isn't used.
+int set_movie_lock(int fd, off_t offset, off_t size, short type)
+{
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = offset;
+    lock.l_len = size;
+#if defined(F_OFD_SETLK)
+    return fcntl(fd, F_OFD_SETLK, &lock);
+#else
+    return fcntl(fd, F_SETLK, &lock);
+#endif
+}
+
+// Reports whether the file lives on a network or user-space filesystem
+int is_remote_filesystem(int fd)
+{
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) != 0) {
+        return 0;
+    }
+#if defined(__linux__)
+    switch ((uint32_t) sfs.f_type) {
+        case 0x6969:        // NFS
+        case 0x517B:        // SMB
+        case 0xFF534D42:    // CIFS
+        case 0xFE534D42:    // SMB2
+        case 0x65735546:    // FUSE
+        case 0x00C36400:    // Ceph
+        case 0x5346414F:    // AFS
+        case 0x01021997:    // 9P
+        case 0x47504653:    // GPFS
+            return 1;
+        default:
+            return 0;
+    }
+#else
+    return !(sfs.f_flags & MNT_LOCAL);
+#endif
+}
+
+QTVRFixIOStrategy choose_io_strategy(const char *moviePath, const QTVRFixOptions *options, int fd, off_t fileSize, off_t moovOffset, const char **reason)
+{
+    // The longest matching path prefix wins
+    size_t bestLength = 0;
+    QTVRFixIOStrategy strategy = options->ioStrategy;
+    *reason = "requested";
+    if (options->cachePolicy & kQTVRFixCacheDirect) {
+        // A mapping always goes through the cache
+        *reason = "uncached reads";
+        return kQTVRFixIOPread;
+    }
+    for (int i = 0; i < options->ioOverrideCount; i++) {
+        const QTVRFixIOOverride *override = &options->ioOverrides[i];
+        size_t length = strlen(override->pathPrefix);
+        if (length >= bestLength && strncmp(moviePath, override->pathPrefix, length) == 0) {
+            bestLength = length;
+            strategy = override->strategy;
+            *reason = "path override";
+        }
+    }
+    if (strategy != kQTVRFixIOAuto) {
+        return strategy;
+    }
+    
+    if (fileSize > cMaxMappedSize) {
+        *reason = "too large to map";
+        return kQTVRFixIOPread;
+    }
+    if (is_remote_filesystem(fd)) {
+        *reason = "network filesystem";
+        return kQTVRFixIOPread;
+    }
+    if (fileSize <= cSmallFileSize) {
+        *reason = "small local file";
+        return kQTVRFixIOMmap;
+    }
+    if (moovOffset < cSmallFileSize) {
+        *reason = "moov near start";
+        return kQTVRFixIOMmap;
+    }
+    *reason = "moov far into large file";
+    return kQTVRFixIOPread;
+}
+
+const char *qtvrfix_moov_locator_name (QTVRFixMoovLocator locator)
+{
+    switch (locator) {
+        case kQTVRFixMoovTail:           return "tail";
+        case kQTVRFixMoovTailConfirmed:  return "tail, confirmed";
+        default:                         return "forward";
+    }
+}
+
+const char *qtvrfix_io_strategy_name (QTVRFixIOStrategy strategy)
+{
+    switch (strategy) {
+        case kQTVRFixIOMmap:   return "mmap";
+        case kQTVRFixIOPread:  return "pread";
+        default:               return "auto";
+    }
+}
+
+
+#pragma mark Page Cache
+
+// Fills buffer with one byte per page of the movie, bit 0 set when the page is cached.
+// Returns the page count, or 0 if that can't be told.
+size_t read_cache_residency(int fd, off_t base, off_t size, WorkspaceBuffer *buffer)
+{
+    if (size == 0) {
+        return 0;
+    }
+    const off_t pageSize = sysconf(_SC_PAGESIZE);
+    off_t start = base & ~(pageSize - 1);
+    size_t length = size + (base - start);
+    size_t pages = (length + pageSize - 1) / pageSize;
+    
+    // Mapping faults nothing in, so mincore() reports what the page cache holds
+    void *vector = workspace_buffer_reserve(buffer, pages, 0);
+    void *mapping = mmap(NULL, length, PROT_READ, MAP_FILE | MAP_SHARED, fd, start);
+    if (!vector || mapping == MAP_FAILED) {
+        return 0;
+    }
+    int result = mincore(mapping, length, vector);
+    munmap(mapping, length);
+    return (result == 0) ? pages : 0;
+}
+
+// Compares the cache with the state before the movie was read and, when asked, drops
+// the pages that weren't cached then. Pages that were already cached are left alone,
+// as they likely belong to someone else's working set.
+void release_cache_pages(int fd, off_t base, off_t size, int cachePolicy, int patched, QTVRFixWorkspace *workspace, QTVRFixStats *stats)
+{
+    size_t pages = read_cache_residency(fd, base, size, &workspace->residencyAfter);
+    if (pages == 0) {
+        return;
+    }
+    uint8_t *before = workspace->residency.data;
+    const uint8_t *after = workspace->residencyAfter.data;
+    for (size_t i = 0; i < pages; i++) {
+        // 2 marks a page brought in by this movie
+        before[i] = ((after[i] & 1) && !(before[i] & 1)) ? 2 : 0;
+        stats->cachePagesAdded += before[i] >> 1;
+    }
+    if (!(cachePolicy & kQTVRFixCacheDrop) || stats->cachePagesAdded == 0) {
+        return;
+    }
+    
+#if defined(SYNC_FILE_RANGE_WRITE)
+    if (patched) {
+        // Dirty pages can't be dropped; write out the few patched ones first
+        sync_file_range(fd, base, size, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#endif
+#if defined(POSIX_FADV_DONTNEED)
+    const off_t pageSize = sysconf(_SC_PAGESIZE);
+    off_t start = base & ~(pageSize - 1);
+    for (size_t i = 0; i < pages; ) {
+        if (before[i] != 2) {
+            i++;
+            continue;
+        }
+        size_t run = i;
+        while (run < pages && before[run] == 2) {
+            run++;
+        }
+        posix_fadvise(fd, start + (off_t) i * pageSize, (off_t)(run - i) * pageSize, POSIX_FADV_DONTNEED);
+        i = run;
+    }
+#endif
+    
+    if (read_cache_residency(fd, base, size, &workspace->residencyAfter) == pages) {
+        after = workspace->residencyAfter.data;
+        for (size_t i = 0; i < pages; i++) {
+            stats->cachePagesDropped += (before[i] == 2 && !(after[i] & 1)) ? 1 : 0;
+        }
+    }
+}
+
+
+#pragma mark Track Enumeration
+
+// Asks for every page holding a pano sample to be read in, merging neighbouring samples into one request
+void prefetch_sample_pages(MovieFile *movie, const SampleRange *ranges, uint32_t count)
+{
+    const off_t pageSize = sysconf(_SC_PAGESIZE);
+    off_t runStart = 0, runEnd = 0;
+    
+    for (uint32_t i = 0; i <= count; i++) {
+        off_t start = 0, end = 0;
+        if (i < count) {
+            if (ranges[i].offset < 0 || ranges[i].offset + (off_t) ranges[i].size > movie->size) {
+                continue;
+            }
+            start = (movie->base + ranges[i].offset) & ~(pageSize - 1);
+            end = (movie->base + ranges[i].offset + ranges[i].size + pageSize - 1) & ~(pageSize - 1);
+            if (runEnd > runStart && start <= runEnd && end >= runStart) {
+                // overlaps or touches the current run
+                if (start < runStart) runStart = start;
+                if (end > runEnd) runEnd = end;
+                continue;
+            }
+        }
+        if (runEnd > runStart) {
+            madvise(movie_file_page(movie, runStart), runEnd - runStart, MADV_WILLNEED);
+        }
+        runStart = start;
+        runEnd = end;
+    }
+}
+
+typedef struct _enumerate_track_pass {
+    MovieFile *             movie;
+    QTVRFixStats *          stats;
+    int                     mapPolicy;
+    const QTVRFixRuleSet *  rules;
+    void *                  moovData;
+    off_t                   moovOffset;
+    PatchLog *              patchLog;
+    PanoCatalog *           catalog;
+    uint32_t                trackIndex;
+    volatile const int *    cancel;
+    int                     cancelled;
+    int                     malformed;          // a box, table or sample didn't fit where it belongs
+    int                     writeFailed;
+} enumerate_track_pass;
+
+// Applies every matching rule to one track: first the boxes inside the track,
+// then all sample targets during a single walk over the track's samples.
+void enumerate_track_callback(Container trakBox, int *stop, void *passthrough)
+{
+    enumerate_track_pass *pass = (enumerate_track_pass *)passthrough;
+    pass->trackIndex++;
+    Container mdiaBox = find_single_box(&trakBox, 'mdia', &pass->malformed);
+    Container hdlrBox = find_single_box(&mdiaBox, 'hdlr', &pass->malformed);
+    MovieFile *movie = pass->movie;
+    const QTVRFixRuleSet *rules = pass->rules;
+    
+    Box_hdlr *hdlr = (Box_hdlr *) hdlrBox.boxStart;
+    if (!hdlr || pass->cancelled || pass->writeFailed) {
+        return;
+    }
+    if (hdlrBox.boxExtent - hdlrBox.boxStart < offsetof(Box_hdlr, reserved)) {
+        pass->malformed = 1;
+        return;
+    }
+    uint32_t handlerType = ntohl(hdlr->handler_type);
+    
+    // At most one exact and one wildcard handler apply
+    const PatchHandler *handlers[2];
+    int handlerCount = 0;
+    int hasSampleTargets = 0;
+    for (int h = 0; h < rules->handlerCount && handlerCount < 2; h++) {
+        if (rules->handlers[h].handlerType == 0 || rules->handlers[h].handlerType == handlerType) {
+            handlers[handlerCount++] = &rules->handlers[h];
+        }
+    }
+    
+    for (int h = 0; h < handlerCount; h++) {
+        for (int t = 0; t < handlers[h]->targetCount; t++) {
+            const PatchTarget *target = &handlers[h]->targets[t];
+            if (target->inSample) {
+                hasSampleTargets = 1;
+                continue;
+            }
+            
+            uint32_t dataSize;
+            uint8_t *data = find_atom_path(&trakBox, target->path, target->pathDepth, 0, &dataSize, &pass->malformed);
+            off_t dataOffset = pass->moovOffset + ((void *) data - pass->moovData);
+            uint32_t loggedPatches = pass->patchLog->count;
+            DirtyRanges dirty = { 0 };
+            int changedFields = data ? apply_patch_target(target, data, dataSize, pass->patchLog, &dirty, dataOffset) : 0;
+            if (changedFields) {
+                if (movie_file_store(movie, dataOffset, data, &dirty) != 0) {
+                    // The change didn't reach the file, so it isn't counted or logged
+                    pass->patchLog->count = loggedPatches;
+                    pass->writeFailed = 1;
+                    *stop = 1;
+                    return;
+                }
+                pass->stats->patchedFields += changedFields;
+            }
+        }
+    }
+    
+    // The catalog needs every pano sample, even when no rule looks inside them
+    int catalogSamples = pass->catalog->enabled && handlerType == 'pano';
+    if (hasSampleTargets || catalogSamples) {
+        Container minfBox = find_single_box(&mdiaBox, 'minf', &pass->malformed);
+        Container stblBox = find_single_box(&minfBox, 'stbl', &pass->malformed);
+        Container stscBox = find_single_box(&stblBox, 'stsc', &pass->malformed);
+        Container stcoBox = find_single_box(&stblBox, 'stco', &pass->malformed);
+        Container stszBox = find_single_box(&stblBox, 'stsz', &pass->malformed);
+        
+        Box_stsc *stsc = (Box_stsc *) stscBox.boxStart;
+        Box_stco *stco = (Box_stco *) stcoBox.boxStart;
+        Box_stsz *stsz = (Box_stsz *) stszBox.boxStart;
+        if (!stsc || !stco || !stsz) {
+            return;
+        }
+        if (!sample_tables_fit(stsc, stscBox.boxExtent - stscBox.boxStart, stco, stcoBox.boxExtent - stcoBox.boxStart,
+                               stsz, stszBox.boxExtent - stszBox.boxStart, movie->size)) {
+            pass->malformed = 1;
+            return;
+        }
+        
+        uint32_t sampleCount = ntohl(stsz->sample_count);
+        SampleRange *ranges = workspace_buffer_reserve(&movie->workspace->ranges, (size_t) sampleCount * sizeof(SampleRange),
+                                                       movie->workspace->hugePages);
+        if (!ranges) {
+            return;
+        }
+        sampleCount = build_sample_ranges(stsc, stco, stsz, ranges);
+        
+        if (movie->mapping && (pass->mapPolicy & kQTVRFixMapPrefetchSamples)) {
+            prefetch_sample_pages(movie, ranges, sampleCount);
+        }
+        
+        int updatedSamples = 0;
+        for (uint32_t sampleIndex = 0; sampleIndex < sampleCount; sampleIndex++) {
+            if (pass->cancel && *pass->cancel) {
+                // Samples already written are complete, so a retry just finishes the rest
+                pass->cancelled = 1;
+                *stop = 1;
+                break;
+            }
+            if (ranges[sampleIndex].offset + (off_t) ranges[sampleIndex].size > movie->size) {
+                pass->malformed = 1;
+                continue;
+            }
+            void *sample = movie_file_load(movie, ranges[sampleIndex].offset, ranges[sampleIndex].size);
+            if (!sample) {
+                fprintf(stderr, "Could not read sample %u\n", sampleIndex + 1);
+                continue;
+            }
+            
+            Container sampleContainer;
+            if (init_container_atom_container((AtomContainer *) sample, ranges[sampleIndex].size, &sampleContainer) != 0) {
+                pass->malformed = 1;
+                continue;
+            }
+            if (sampleContainer.boxHeader.type != 'sean') {
+                continue;
+            }
+            
+            int changedFields = 0;
+            uint32_t loggedPatches = pass->patchLog->count;
+            DirtyRanges dirty = { 0 };
+            for (int h = 0; h < handlerCount; h++) {
+                for (int t = 0; t < handlers[h]->targetCount; t++) {
+                    const PatchTarget *target = &handlers[h]->targets[t];
+                    if (!target->inSample) {
+                        continue;
+                    }
+                    
+                    uint32_t dataSize;
+                    uint8_t *data = find_atom_path(&sampleContainer, target->path + 1, target->pathDepth - 1, 1, &dataSize, &pass->malformed);
+                    if (data) {
+                        off_t dataOffset = ranges[sampleIndex].offset + ((void *) data - sample);
+                        changedFields += apply_patch_target(target, data, dataSize, pass->patchLog, &dirty, dataOffset);
+                    }
+                }
+            }
+            
+            if (changedFields) {
+                if (movie_file_store(movie, ranges[sampleIndex].offset, sample, &dirty) != 0) {
+                    pass->patchLog->count = loggedPatches;
+                    pass->writeFailed = 1;
+                    *stop = 1;
+                    break;
+                }
+                updatedSamples++;
+                pass->stats->patchedFields += changedFields;
+            }
+            
+            if (catalogSamples) {
+                static const uint32_t cPdatPath[] = { 'pdat' };
+                uint32_t dataSize;
+                uint8_t *pdat = find_atom_path(&sampleContainer, cPdatPath, 1, 1, &dataSize, &pass->malformed);
+                if (pdat && dataSize >= sizeof(QTVRPanoSampleAtom)) {
+                    pano_catalog_add(pass->catalog, pass->trackIndex, sampleIndex + 1, pdat);
+                }
+            }
+        }
+        
+        if (handlerType == 'pano') {
+            pass->stats->panoSamples += sampleCount;
+        }
+        pass->stats->updatedSamples += updatedSamples;
+    }
+}
+
+// Applies the paging hints for the moov range of a fresh mapping
+void apply_moov_map_policy(MovieFile *movie, int mapPolicy, off_t moovOffset, uint64_t moovSize)
+{
+    const off_t pageSize = sysconf(_SC_PAGESIZE);
+    off_t start = (movie->base + moovOffset) & ~(pageSize - 1);
+    off_t end = (movie->base + moovOffset + moovSize + pageSize - 1) & ~(pageSize - 1);
+    if (end > movie->mapOffset + (off_t) movie->mapLength) {
+        end = movie->mapOffset + movie->mapLength;
+    }
+    
+    if (mapPolicy & kQTVRFixMapRandom) {
+        madvise(movie->mapStart, movie->mapLength, MADV_RANDOM);
+    }
+    if (mapPolicy & kQTVRFixMapWillNeedMoov) {
+        madvise(movie_file_page(movie, start), end - start, MADV_WILLNEED);
+    }
+    if (mapPolicy & kQTVRFixMapPopulateMoov) {
+#if defined(MAP_POPULATE)
+        // Replace just the moov pages with a prefaulted mapping of the same file range
+        void *moovPages = mmap(movie_file_page(movie, start), end - start, PROT_READ | PROT_WRITE,
+                               MAP_FILE | MAP_SHARED | MAP_FIXED | MAP_POPULATE, movie->fd, start);
+        if (moovPages == MAP_FAILED) {
+            fprintf(stderr, "Failed to prefault movie atom: %d\n", errno);
+        }
+#else
+        volatile uint8_t sum = 0;
+        for (off_t page = start; page < end; page += pageSize) {
+            sum += *((uint8_t *) movie_file_page(movie, page));
+        }
+#endif
+    }
+}
+
+// Page faults taken so far by the calling thread (or process where per-thread counts aren't available)
+void read_fault_counts(long *minorFaults, long *majorFaults)
+{
+    struct rusage usage;
+#if defined(RUSAGE_THREAD)
+    getrusage(RUSAGE_THREAD, &usage);
+#else
+    getrusage(RUSAGE_SELF, &usage);
+#endif
+    *minorFaults = usage.ru_minflt;
+    *majorFaults = usage.ru_majflt;
+}
+
+double current_time(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+#pragma mark Inspection
+
+#define MAX_INSPECT_DEPTH       32
+#define MAX_INSPECT_TRACKS      64
+
+// Output sink for the inspector; text or one JSON object per file
+typedef struct _InspectWriter {
+    FILE *      out;
+    int         json;
+    int         needComma;
+} InspectWriter;
+
+void inspect_json_string(FILE *out, const char *str, size_t length)
+{
+    fputc('"', out);
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c < 0x20 || c >= 0x7f) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+void inspect_fourcc(InspectWriter *writer, uint32_t type)
+{
+    char fourcc[4] = { type >> 24, type >> 16, type >> 8, type };
+    if (writer->json) {
+        inspect_json_string(writer->out, fourcc, 4);
+    } else {
+        fputc('\'', writer->out);
+        for (int i = 0; i < 4; i++) {
+            fputc((fourcc[i] >= 0x20 && fourcc[i] < 0x7f) ? fourcc[i] : '.', writer->out);
+        }
+        fputc('\'', writer->out);
+    }
+}
+
+// Starts a "key": value pair (JSON) or " key=" (text)
+void inspect_key(InspectWriter *writer, const char *key)
+{
+    if (writer->json) {
+        fprintf(writer->out, "%s\"%s\":", writer->needComma ? "," : "", key);
+        writer->needComma = 1;
+    } else {
+        fprintf(writer->out, " %s=", key);
+    }
+}
+
+void inspect_number(InspectWriter *writer, const char *key, unsigned long long value)
+{
+    inspect_key(writer, key);
+    fprintf(writer->out, "%llu", value);
+}
+
+void inspect_open(InspectWriter *writer, const char *key, char bracket)
+{
+    if (writer->json) {
+        if (key) {
+            inspect_key(writer, key);
+        } else if (writer->needComma) {
+            fputc(',', writer->out);
+        }
+        fputc(bracket, writer->out);
+        writer->needComma = 0;
+    }
+}
+
+void inspect_close(InspectWriter *writer, char bracket)
+{
+    if (writer->json) {
+        fputc(bracket, writer->out);
+        writer->needComma = 1;
+    }
+}
+
+// Reports the useful fields of the boxes the table knows about
+void inspect_box_details(InspectWriter *writer, const BoxTypeInfo *info, const uint8_t *box, uint64_t size, uint32_t headerSize)
+{
+    const uint8_t *data = box + headerSize;
+    uint64_t dataSize = size - headerSize;
+    const PatchField cWord[4] = { { 0, 4, kFieldUnsigned }, { 4, 4, kFieldUnsigned }, { 8, 4, kFieldUnsigned }, { 12, 4, kFieldUnsigned } };
+    
+    switch (info ? info->kind : kBoxPlain) {
+        case kBoxFileType:
+            if (dataSize >= 4) {
+                inspect_key(writer, "brand");
+                inspect_fourcc(writer, read_field(data, &cWord[0]));
+            }
+            break;
+        case kBoxHandler:
+            if (dataSize >= 12) {
+                inspect_key(writer, "handler");
+                inspect_fourcc(writer, read_field(data, &cWord[2]));
+            }
+            break;
+        case kBoxSampleSize:
+            if (dataSize >= 12) {
+                inspect_number(writer, "sampleSize", read_field(data, &cWord[1]));
+                inspect_number(writer, "samples", read_field(data, &cWord[2]));
+            }
+            break;
+        case kBoxChunkOffset:
+        case kBoxChunkOffset64:
+            if (dataSize >= 8) {
+                inspect_number(writer, "chunks", read_field(data, &cWord[1]));
+            }
+            break;
+        case kBoxSampleToChunk:
+        case kBoxTimeToSample:
+            if (dataSize >= 8) {
+                inspect_number(writer, "entries", read_field(data, &cWord[1]));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Sample tables of one track, remembered while walking so its samples can be listed afterwards
+typedef struct _InspectTrack {
+    uint32_t    handlerType;
+    Box_stsc *  stsc;
+    Box_stco *  stco;
+    Box_stsz *  stsz;
+    uint64_t    stscSize, stcoSize, stszSize;
+} InspectTrack;
+
+// Lists the QT atom tree of a pano sample and decodes its 'pdat' atom
+void inspect_pano_sample(InspectWriter *writer, const uint8_t *sample, uint32_t sampleSize)
+{
+    const uint8_t *pdat = NULL;
+    const uint8_t *end = sample + sampleSize;
+    const uint8_t *cursors[MAX_INSPECT_DEPTH], *extents[MAX_INSPECT_DEPTH];
+    int depth = 0;
+    
+    // The 'sean' atom follows the 12-byte atom container header
+    cursors[0] = sample + offsetof(AtomContainer, size);
+    extents[0] = end;
+    
+    inspect_open(writer, "atoms", '[');
+    while (depth >= 0) {
+        const uint8_t *atom = cursors[depth];
+        if (atom + sizeof(AtomHeader) > extents[depth]) {
+            depth--;
+            continue;
+        }
+        
+        const AtomHeader *header = (const AtomHeader *) atom;
+        uint32_t size = ntohl(header->size);
+        uint32_t type = ntohl(header->type);
+        uint16_t childCount = ntohs(header->child_count);
+        if (size < sizeof(AtomHeader) || size > (uint64_t)(extents[depth] - atom)) {
+            if (writer->json) {
+                inspect_open(writer, NULL, '{');
+                inspect_key(writer, "error");
+                fputs("\"bad size\"", writer->out);
+                inspect_number(writer, "depth", depth);
+                inspect_number(writer, "size", size);
+                inspect_close(writer, '}');
+            } else {
+                fprintf(writer->out, "%*satom with bad size %u\n", 8 + 2 * depth, "", size);
+            }
+            depth--;
+            continue;
+        }
+        cursors[depth] = atom + size;
+        
+        inspect_open(writer, NULL, '{');
+        if (!writer->json) {
+            fprintf(writer->out, "%*s", 8 + 2 * depth, "");
+            inspect_fourcc(writer, type);
+        } else {
+            inspect_key(writer, "type");
+            inspect_fourcc(writer, type);
+        }
+        inspect_number(writer, "depth", depth);
+        inspect_number(writer, "id", ntohl(header->atom_id));
+        inspect_number(writer, "size", size);
+        inspect_number(writer, "children", childCount);
+        inspect_close(writer, '}');
+        if (!writer->json) {
+            fputc('\n', writer->out);
+        }
+        
+        if (type == 'pdat' && size >= sizeof(AtomHeader) + sizeof(QTVRPanoSampleAtom)) {
+            pdat = header->contents;
+        }
+        if (childCount > 0 && depth + 1 < MAX_INSPECT_DEPTH) {
+            depth++;
+            cursors[depth] = header->contents;
+            extents[depth] = atom + size;
+        }
+    }
+    inspect_close(writer, ']');
+    
+    if (pdat) {
+        if (writer->json) {
+            inspect_open(writer, "pdat", '{');
+        } else {
+            fprintf(writer->out, "%8spdat", "");
+        }
+        for (int i = 0; i < sizeof(cNamedFields) / sizeof(NamedField); i++) {
+            const NamedField *named = &cNamedFields[i];
+            uint32_t value = read_field(pdat, &named->field);
+            inspect_key(writer, named->name);
+            if (named->field.kind == kFieldFloat && writer->json && !isfinite(field_bits_to_float(value))) {
+                // JSON has no NaN or infinity
+                fputs("null", writer->out);
+            } else if (named->field.kind == kFieldFloat) {
+                fprintf(writer->out, "%g", field_bits_to_float(value));
+            } else {
+                fprintf(writer->out, "%u", value);
+            }
+        }
+        inspect_close(writer, '}');
+        if (!writer->json) {
+            fputc('\n', writer->out);
+        }
+    }
+}
+
+void inspect_pano_tracks(InspectWriter *writer, const uint8_t *movieData, off_t movieSize, InspectTrack *tracks, int trackCount)
+{
+    inspect_open(writer, "panoTracks", '[');
+    
+    for (int t = 0; t < trackCount; t++) {
+        InspectTrack *track = &tracks[t];
+        if (track->handlerType != 'pano' ||
+            !sample_tables_fit(track->stsc, track->stscSize, track->stco, track->stcoSize, track->stsz, track->stszSize, movieSize)) {
+            continue;
+        }
+        
+        uint32_t sampleCount = ntohl(track->stsz->sample_count);
+        SampleRange *ranges = malloc(sampleCount * sizeof(SampleRange));
+        if (!ranges) {
+            continue;
+        }
+        sampleCount = build_sample_ranges(track->stsc, track->stco, track->stsz, ranges);
+        
+        inspect_open(writer, NULL, '{');
+        if (!writer->json) {
+            fprintf(writer->out, "pano");
+        }
+        inspect_number(writer, "track", t + 1);
+        inspect_number(writer, "sampleCount", sampleCount);
+        if (!writer->json) {
+            fputc('\n', writer->out);
+        }
+        
+        inspect_open(writer, "samples", '[');
+        for (uint32_t i = 0; i < sampleCount; i++) {
+            inspect_open(writer, NULL, '{');
+            if (!writer->json) {
+                fprintf(writer->out, "    sample");
+            }
+            inspect_number(writer, "index", i + 1);
+            inspect_number(writer, "offset", ranges[i].offset);
+            inspect_number(writer, "size", ranges[i].size);
+            if (!writer->json) {
+                fputc('\n', writer->out);
+            }
+            if (ranges[i].offset >= 0 && ranges[i].offset + (off_t) ranges[i].size <= movieSize) {
+                inspect_pano_sample(writer, movieData + ranges[i].offset, ranges[i].size);
+            }
+            inspect_close(writer, '}');
+        }
+        inspect_close(writer, ']');
+        inspect_close(writer, '}');
+        free(ranges);
+    }
+    
+    inspect_close(writer, ']');
+}
+
+// Walks the whole box tree with an explicit stack rather than recursion. Every track
+// is counted in trackCount, but only the first MAX_INSPECT_TRACKS are remembered.
+void inspect_boxes(InspectWriter *writer, const uint8_t *movieData, off_t movieSize, InspectTrack *tracks, int *trackCount)
+{
+    const uint8_t *cursors[MAX_INSPECT_DEPTH], *extents[MAX_INSPECT_DEPTH];
+    int depth = 0;
+    InspectTrack *track = NULL;
+    
+    cursors[0] = movieData;
+    extents[0] = movieData + movieSize;
+    
+    inspect_open(writer, "boxes", '[');
+    while (depth >= 0) {
+        const uint8_t *box = cursors[depth];
+        uint64_t available = extents[depth] - box;
+        if (available < sizeof(BoxHeader)) {
+            depth--;
+            continue;
+        }
+        
+        BoxHeader header = read_box_header((void *) box);
+        uint64_t size = header.size;
+        uint32_t headerSize = sizeof(BoxHeader);
+        if (size == 1 && available >= 16) {
+            const PatchField largeSize[2] = { { 8, 4, kFieldUnsigned }, { 12, 4, kFieldUnsigned } };
+            size = ((uint64_t) read_field(box, &largeSize[0]) << 32) | read_field(box, &largeSize[1]);
+            headerSize = 16;
+        } else if (size == 0) {
+            // Box extends to the end of its parent
+            size = available;
+        }
+        
+        inspect_open(writer, NULL, '{');
+        if (!writer->json) {
+            fprintf(writer->out, "%*s", 2 * depth, "");
+            inspect_fourcc(writer, header.type);
+        } else {
+            inspect_key(writer, "type");
+            inspect_fourcc(writer, header.type);
+        }
+        inspect_number(writer, "depth", depth);
+        inspect_number(writer, "offset", box - movieData);
+        inspect_number(writer, "size", size);
+        
+        if (size < headerSize || size > available) {
+            inspect_key(writer, "error");
+            fputs(writer->json ? "\"bad size\"" : "bad-size", writer->out);
+            inspect_close(writer, '}');
+            if (!writer->json) {
+                fputc('\n', writer->out);
+            }
+            // Nothing after a bad size at this level can be trusted
+            depth--;
+            continue;
+        }
+        
+        const BoxTypeInfo *info = lookup_box_type(header.type);
+        inspect_box_details(writer, info, box, size, headerSize);
+        inspect_close(writer, '}');
+        if (!writer->json) {
+            fputc('\n', writer->out);
+        }
+        cursors[depth] = box + size;
+        
+        // Remember the sample tables of each track
+        if (header.type == 'trak') {
+            track = (*trackCount < MAX_INSPECT_TRACKS) ? &tracks[*trackCount] : NULL;
+            (*trackCount)++;
+            if (track) {
+                memset(track, 0, sizeof(InspectTrack));
+            }
+        } else if (track && header.type == 'hdlr' && !track->handlerType && size >= sizeof(Box_hdlr)) {
+            track->handlerType = ntohl(((const Box_hdlr *) box)->handler_type);
+        } else if (track && header.type == 'stsc' && !track->stsc) {
+            track->stsc = (Box_stsc *) box;
+            track->stscSize = size;
+        } else if (track && header.type == 'stco' && !track->stco) {
+            track->stco = (Box_stco *) box;
+            track->stcoSize = size;
+        } else if (track && header.type == 'stsz' && !track->stsz) {
+            track->stsz = (Box_stsz *) box;
+            track->stszSize = size;
+        }
+        
+        if (info && info->isContainer && depth + 1 < MAX_INSPECT_DEPTH) {
+            const uint8_t *children = box + headerSize;
+            // ISO 'meta' is a full box; QuickTime's isn't
+            if (header.type == 'meta' && size >= headerSize + 4 && read_field(children, &(PatchField){ 0, 4, kFieldUnsigned }) == 0) {
+                children += 4;
+            }
+            depth++;
+            cursors[depth] = children;
+            extents[depth] = box + size;
+        }
+    }
+    inspect_close(writer, ']');
+}
+
+int qtvrfix_inspect (const char *moviePath, QTVRFixInspectFormat format, FILE *output)
+{
+    int fd = open(moviePath, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "File not found: %s\n", moviePath);
+        return kQTVRFixErrNotFound;
+    }
+    
+    struct stat fs;
+    fstat(fd, &fs);
+    void *movieData = NULL;
+    if (fs.st_size > 0) {
+        movieData = mmap(0, fs.st_size, PROT_READ, MAP_FILE | MAP_PRIVATE, fd, 0);
+        if (movieData == MAP_FAILED) {
+            fprintf(stderr, "Failed to map file %s\n", moviePath);
+            close(fd);
+            return kQTVRFixErrMapFailed;
+        }
+        // Only headers and a few samples are read
+        madvise(movieData, fs.st_size, MADV_RANDOM);
+    }
+    
+    InspectWriter writer = { output, format == kQTVRFixInspectJSON, 0 };
+    InspectTrack tracks[MAX_INSPECT_TRACKS];
+    int trackCount = 0;
+    
+    inspect_open(&writer, NULL, '{');
+    if (writer.json) {
+        inspect_key(&writer, "file");
+        inspect_json_string(output, moviePath, strlen(moviePath));
+    } else {
+        fprintf(output, "%s:", moviePath);
+    }
+    inspect_number(&writer, "size", fs.st_size);
+    if (!writer.json) {
+        fputc('\n', output);
+    }
+    
+    if (movieData) {
+        inspect_boxes(&writer, movieData, fs.st_size, tracks, &trackCount);
+        inspect_pano_tracks(&writer, movieData, fs.st_size, tracks, (trackCount < MAX_INSPECT_TRACKS) ? trackCount : MAX_INSPECT_TRACKS);
+        munmap(movieData, fs.st_size);
+        if (trackCount > MAX_INSPECT_TRACKS) {
+            if (writer.json) {
+                inspect_number(&writer, "tracksNotInspected", trackCount - MAX_INSPECT_TRACKS);
+            } else {
+                fprintf(output, "%d tracks past the first %d not inspected\n", trackCount - MAX_INSPECT_TRACKS, MAX_INSPECT_TRACKS);
+            }
+        }
+    }
+    inspect_close(&writer, '}');
+    if (writer.json) {
+        fputc('\n', output);
+    }
+    close(fd);
+    
+    return kQTVRFixNoErr;
+}
+
+const char *qtvrfix_result_name (int result)
+{
+    switch (result) {
+        case kQTVRFixNoErr:           return "ok";
+        case kQTVRFixErrNotFound:     return "not found";
+        case kQTVRFixErrTooLarge:     return "too large";
+        case kQTVRFixErrMapFailed:    return "map failed";
+        case kQTVRFixErrWriteFailed:  return "write failed";
+        case kQTVRFixErrNoMovie:      return "no movie atom";
+        case kQTVRFixErrReadFailed:   return "read failed";
+        case kQTVRFixErrStalled:      return "stalled";
+        case kQTVRFixErrMalformed:    return "malformed";
+        case kQTVRFixErrBusy:         return "busy";
+        default:                      return "unknown";
+    }
+}
+
+int qtvrfix (const char *moviePath)
+{
+    return qtvrfix_with_options(moviePath, NULL, NULL);
+}
+
+void qtvrfix_stats_free (QTVRFixStats *stats)
+{
+    if (!stats->inWorkspace) {
+        free(stats->patches);
+        free(stats->panoRecords);
+    }
+    stats->patches = NULL;
+    stats->patchCount = 0;
+    stats->panoRecords = NULL;
+    stats->panoRecordCount = 0;
+}
+
+// Part of the file's identity in the catalog, taken after the repair so it matches the file
+void read_modified_time(int fd, QTVRFixStats *stats)
+{
+    struct stat fs;
+    if (fstat(fd, &fs) == 0) {
+        stats->modifiedTime = fs.st_mtime;
+    }
+}
+
+int qtvrfix_with_options (const char *moviePath, const QTVRFixOptions *options, QTVRFixStats *stats)
+{
+    QTVRFixStats localStats;
+    if (!stats) {
+        stats = &localStats;
+    }
+    
+    int fd = open(moviePath, O_RDWR);
+    if (fd == -1) {
+        memset(stats, 0, sizeof(QTVRFixStats));
+        printf("File not found: %s\n", moviePath);
+        return kQTVRFixErrNotFound;
+    }
+    
+    // get file size
+    struct stat fs;
+    fstat(fd, &fs);
+    
+    int status = qtvrfix_member(fd, 0, fs.st_size, moviePath, options, stats);
+    // Whatever was patched is synced, even when the movie couldn't be repaired completely
+    if (stats->patchedFields && fsync(fd) == -1) {
+        if (options && options->cancel && *options->cancel) {
+            status = kQTVRFixErrStalled;
+        } else {
+            fprintf(stderr, "Error writing file: %d\n", errno);
+            status = kQTVRFixErrWriteFailed;
+        }
+    }
+    if (options && options->catalog) {
+        // Changes made through a mapping are only sure to update the time once synced
+        read_modified_time(fd, stats);
+    }
+    close(fd);
+    
+    if (stats == &localStats) {
+        qtvrfix_stats_free(stats);
+    }
+    return status;
+}
+
+int fix_movie(int fd, off_t offset, off_t size, const char *name, const QTVRFixOptions *options, QTVRFixStats *stats, QTVRFixWorkspace *workspace)
+{
+    stats->movieOffset = offset;
+    stats->fileSize = size;
+    
+    double startTime = current_time();
+    long startMinorFaults, startMajorFaults;
+    read_fault_counts(&startMinorFaults, &startMajorFaults);
+    
+    off_t moovOffset;
+    uint64_t moovSize;
+    if (!locate_moov(fd, offset, size, &moovOffset, &moovSize, &stats->moovLocator, workspace)) {
+        // A cancelled read looks like a missing box
+        if (options->cancel && *options->cancel) {
+            return kQTVRFixErrStalled;
+        }
+        fprintf(stderr, "No movie atom found in %s\n", name);
+        return kQTVRFixErrNoMovie;
+    }
+    stats->moovOffset = moovOffset;
+    stats->moovSize = moovSize;
+    
+    QTVRFixIOStrategy strategy = choose_io_strategy(name, options, fd, size, moovOffset, &stats->ioReason);
+    stats->ioStrategy = strategy;
+    
+    MovieFile movie = { fd, fd, offset, size, NULL, NULL, 0, 0, workspace, 0 };
+    void *moovData;
+    
+    if (strategy == kQTVRFixIOMmap) {
+        if (size > cMaxMappedSize) {
+            fprintf(stderr, "File %s is larger than allowed (%lld bytes > %lld)\n", name, (long long) size, (long long) cMaxMappedSize);
+            return kQTVRFixErrTooLarge;
+        }
+        
+        // map file to memory
+        if (movie_file_map(&movie) != 0) {
+            fprintf(stderr, "Failed to map file %s\n", name);
+            return kQTVRFixErrMapFailed;
+        }
+        apply_moov_map_policy(&movie, options->mapPolicy, moovOffset, moovSize);
+        moovData = movie.mapping + moovOffset;
+    } else {
+        if (moovSize > cMaxMovieAtomSize) {
+            fprintf(stderr, "Movie atom in %s is larger than allowed (%llu bytes)\n", name, (unsigned long long) moovSize);
+            return kQTVRFixErrTooLarge;
+        }
+        
+        if (options->cachePolicy & kQTVRFixCacheDirect) {
+            movie.readFd = open_uncached_reader(fd);
+        }
+        moovData = movie_file_read(&movie, &workspace->moov, moovOffset, moovSize);
+        if (!moovData) {
+            if (movie.readFd != fd) {
+                close(movie.readFd);
+            }
+            if (options->cancel && *options->cancel) {
+                return kQTVRFixErrStalled;
+            }
+            fprintf(stderr, "Error reading file %s: %d\n", name, errno);
+            return kQTVRFixErrReadFailed;
+        }
+    }
+    
+    const QTVRFixRuleSet *rules = options->rules ? options->rules : built_in_rules();
+    PatchLog patchLog = { options->digest, &workspace->patches, 0 };
+    if (patchLog.enabled && options->priorPatchCount) {
+        // The earlier attempt's fields already hold their new values, so this pass won't log them again
+        QTVRFixPatch *patches = workspace_buffer_reserve(patchLog.buffer, options->priorPatchCount * sizeof(QTVRFixPatch), 0);
+        if (patches) {
+            memcpy(patches, options->priorPatches, options->priorPatchCount * sizeof(QTVRFixPatch));
+            patchLog.count = options->priorPatchCount;
+            stats->patchedFields = options->priorPatchCount;
+        }
+    }
+    PanoCatalog catalog = { options->catalog, &workspace->panoRecords, 0 };
+    enumerate_track_pass trackPass = { &movie, stats, options->mapPolicy, rules, moovData, moovOffset, &patchLog, &catalog, 0,
+                                       options->cancel, 0, 0, 0 };
+    
+    // The header may carry a 64-bit size, so bound the box by what was located
+    Container moovBox;
+    if (init_child_box(moovData, moovData + moovSize, &moovBox) != 0 ||
+        enumerate_boxes(&moovBox, ('trak'), enumerate_track_callback, &trackPass) != 0) {
+        trackPass.malformed = 1;
+    }
+    
+    // Changes stay in the page cache; the caller syncs the whole file once
+    if (movie.mapping) {
+        munmap(movie.mapStart, movie.mapLength);
+    }
+    if (movie.readFd != fd) {
+        close(movie.readFd);
+    }
+    
+    // A write interrupted by the watchdog's signal is a stall, so the movie is retried with
+    // the fields already written rather than given up on
+    int cancelled = trackPass.cancelled || (trackPass.writeFailed && options->cancel && *options->cancel);
+    int status = cancelled ? kQTVRFixErrStalled : trackPass.writeFailed ? kQTVRFixErrWriteFailed :
+                 trackPass.malformed ? kQTVRFixErrMalformed : kQTVRFixNoErr;
+    stats->patches = patchLog.count ? workspace->patches.data : NULL;
+    stats->patchCount = patchLog.count;
+    stats->panoRecords = catalog.count ? workspace->panoRecords.data : NULL;
+    stats->panoRecordCount = catalog.count;
+    if (options->digest && (status == kQTVRFixNoErr || (stats->patchedFields && status != kQTVRFixErrStalled))) {
+        // Hash what is in the file now, with the patched fields masked out, so the digest
+        // also matches the untouched original. A partly repaired movie is changed on disk
+        // too, so it gets a digest as well; a stalled one is hashed when it is retried.
+        uint8_t *buffers = workspace_buffer_reserve(&workspace->digest, digest_buffers_size(size, options->digestThreads), workspace->hugePages);
+        uint64_t *chunkHashes = workspace_buffer_reserve(&workspace->digestHashes, digest_hashes_size(size), 0);
+        if (digest_file(fd, offset, size, stats->patches, stats->patchCount, options->digestThreads, buffers, chunkHashes,
+                        options->cancel, stats->digest) == 0) {
+            stats->hasDigest = 1;
+        } else if (options->cancel && *options->cancel) {
+            status = kQTVRFixErrStalled;
+        } else {
+            fprintf(stderr, "Error reading file %s for digest: %d\n", name, errno);
+            status = kQTVRFixErrReadFailed;
+        }
+    }
+    
+    long minorFaults, majorFaults;
+    read_fault_counts(&minorFaults, &majorFaults);
+    stats->minorFaults = minorFaults - startMinorFaults;
+    stats->majorFaults = majorFaults - startMajorFaults;
+    stats->seconds = current_time() - startTime;
+    
+    return status;
+}
+
+int qtvrfix_member (int fd, off_t offset, off_t size, const char *name, const QTVRFixOptions *options, QTVRFixStats *stats)
+{
+    QTVRFixOptions defaultOptions;
+    QTVRFixStats localStats;
+    if (!options) {
+        memset(&defaultOptions, 0, sizeof(QTVRFixOptions));
+        options = &defaultOptions;
+    }
+    if (!stats) {
+        stats = &localStats;
+    }
+    memset(stats, 0, sizeof(QTVRFixStats));
+    
+    // Fails at once rather than waiting, so a busy movie can be retried later
+    if (options->lock && set_movie_lock(fd, offset, size, F_WRLCK) == -1) {
+        if (errno == EAGAIN || errno == EACCES) {
+            return kQTVRFixErrBusy;
+        }
+        fprintf(stderr, "Could not lock %s: %d\n", name, errno);
+    }
+    
+    QTVRFixWorkspace localWorkspace;
+    QTVRFixWorkspace *workspace = options->workspace;
+    if (!workspace) {
+        memset(&localWorkspace, 0, sizeof(QTVRFixWorkspace));
+        workspace = &localWorkspace;
+    }
+    
+    int cacheTracked = options->cachePolicy && read_cache_residency(fd, offset, size, &workspace->residency) != 0;
+    int status = fix_movie(fd, offset, size, name, options, stats, workspace);
+    if (options->catalog) {
+        read_modified_time(fd, stats);
+    }
+    if (cacheTracked) {
+        release_cache_pages(fd, offset, size, options->cachePolicy, stats->patchedFields != 0, workspace, stats);
+    }
+    
+    if (workspace == &localWorkspace) {
+        // These lists never use huge pages, so they came from malloc and the caller can own them
+        if (stats->patches) {
+            memset(&workspace->patches, 0, sizeof(WorkspaceBuffer));
+        }
+        if (stats->panoRecords) {
+            memset(&workspace->panoRecords, 0, sizeof(WorkspaceBuffer));
+        }
+        workspace_release(workspace);
+    } else {
+        stats->inWorkspace = 1;
+    }
+    if (options->lock) {
+        set_movie_lock(fd, offset, size, F_UNLCK);
+    }
+    
+    if (stats == &localStats) {
+        qtvrfix_stats_free(stats);
+    }
+    return status;
+}
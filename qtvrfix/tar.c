@@ -0,0 +1,262 @@
+//
+//  tar.c
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tar.h"
+
+#define TAR_BLOCK_SIZE          512
+// Largest GNU long name or pax header that will be read
+#define MAX_EXTENDED_HEADER     (1024 * 1024)
+
+// Field offsets in a header block
+enum {
+    kTarName        = 0,
+    kTarSize        = 124,
+    kTarChecksum    = 148,
+    kTarType        = 156,
+    kTarMagic       = 257,
+    kTarPrefix      = 345
+};
+
+// Octal, or base-256 when the top bit of the first byte is set (GNU, for sizes over 8 GB)
+static int parse_number(const uint8_t *field, size_t length, off_t *value)
+{
+    off_t result = 0;
+    
+    if (field[0] & 0x80) {
+        if (field[0] != 0x80) {
+            return -1;  // negative, or too large for off_t
+        }
+        for (size_t i = 1; i < length; i++) {
+            if (result > (INT64_MAX >> 8)) {
+                return -1;
+            }
+            result = (result << 8) | field[i];
+        }
+        *value = result;
+        return 0;
+    }
+    
+    size_t i = 0;
+    while (i < length && (field[i] == ' ' || field[i] == '\0')) {
+        i++;
+    }
+    for (; i < length && field[i] >= '0' && field[i] <= '7'; i++) {
+        result = (result << 3) | (field[i] - '0');
+    }
+    if (i < length && field[i] != ' ' && field[i] != '\0') {
+        return -1;
+    }
+    *value = result;
+    return 0;
+}
+
+// Old archivers summed signed chars, so accept either sum
+static int checksum_matches(const uint8_t *header)
+{
+    off_t expected;
+    if (parse_number(header + kTarChecksum, 8, &expected) != 0) {
+        return 0;
+    }
+    
+    long unsignedSum = 0, signedSum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        uint8_t c = (i >= kTarChecksum && i < kTarChecksum + 8) ? ' ' : header[i];
+        unsignedSum += c;
+        signedSum += (signed char) c;
+    }
+    return expected == unsignedSum || expected == signedSum;
+}
+
+static int is_zero_block(const uint8_t *block)
+{
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        if (block[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Joins the POSIX prefix and name fields, which aren't NUL-terminated when full
+static char *header_name(const uint8_t *header)
+{
+    char name[155 + 1 + 100 + 1];
+    size_t length = 0;
+    
+    // GNU archives use the prefix area for other fields and spell the magic "ustar  "
+    if (memcmp(header + kTarMagic, "ustar", 6) == 0 && header[kTarPrefix]) {
+        length = strnlen((const char *) header + kTarPrefix, 155);
+        memcpy(name, header + kTarPrefix, length);
+        name[length++] = '/';
+    }
+    size_t nameLength = strnlen((const char *) header + kTarName, 100);
+    memcpy(name + length, header + kTarName, nameLength);
+    name[length + nameLength] = '\0';
+    return strdup(name);
+}
+
+static int read_fully(int fd, void *buffer, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = pread(fd, (uint8_t *) buffer + done, size - done, offset + done);
+        if (count <= 0) {
+            return -1;
+        }
+        done += count;
+    }
+    return 0;
+}
+
+// Picks 'path' and 'size' out of pax records, each "LENGTH KEY=VALUE\n"
+static void parse_pax_records(char *records, size_t length, char **path, off_t *size)
+{
+    char *cursor = records;
+    char *end = records + length;
+    
+    while (cursor < end) {
+        char *afterLength;
+        long recordLength = strtol(cursor, &afterLength, 10);
+        if (recordLength <= 0 || recordLength > end - cursor || *afterLength != ' ') {
+            break;
+        }
+        char *key = afterLength + 1;
+        char *recordEnd = cursor + recordLength - 1;     // the newline
+        char *equals = memchr(key, '=', recordEnd - key);
+        
+        if (equals && *recordEnd == '\n') {
+            *recordEnd = '\0';
+            if (equals - key == 4 && memcmp(key, "path", 4) == 0) {
+                free(*path);
+                *path = strdup(equals + 1);
+            } else if (equals - key == 4 && memcmp(key, "size", 4) == 0) {
+                *size = strtoll(equals + 1, NULL, 10);
+            }
+        }
+        cursor += recordLength;
+    }
+}
+
+static void add_member(TarIndex *index, char *name, off_t offset, off_t size)
+{
+    if (index->count == index->capacity) {
+        index->capacity = index->capacity ? index->capacity * 2 : 64;
+        index->members = realloc(index->members, index->capacity * sizeof(TarMember));
+    }
+    TarMember *member = &index->members[index->count++];
+    member->name = name;
+    member->offset = offset;
+    member->size = size;
+}
+
+int tar_index_read (TarIndex *index, int fd, off_t archiveSize, char *error, size_t errorSize)
+{
+    memset(index, 0, sizeof(TarIndex));
+    
+    uint8_t header[TAR_BLOCK_SIZE];
+    off_t cursor = 0;
+    // Set by GNU 'L' and pax 'x' entries for the header that follows them
+    char *nextName = NULL;
+    off_t nextSize = -1;
+    int status = 0;
+    
+    while (cursor + TAR_BLOCK_SIZE <= archiveSize) {
+        if (read_fully(fd, header, TAR_BLOCK_SIZE, cursor) != 0) {
+            snprintf(error, errorSize, "could not read header at %lld", (long long) cursor);
+            status = -1;
+            break;
+        }
+        if (is_zero_block(header)) {
+            break;  // end of archive
+        }
+        
+        off_t size;
+        if (!checksum_matches(header) || parse_number(header + kTarSize, 12, &size) != 0) {
+            snprintf(error, errorSize, "damaged header at %lld", (long long) cursor);
+            status = -1;
+            break;
+        }
+        if (nextSize >= 0) {
+            size = nextSize;
+        }
+        
+        off_t dataOffset = cursor + TAR_BLOCK_SIZE;
+        if (size < 0 || size > archiveSize - dataOffset) {
+            snprintf(error, errorSize, "member at %lld extends past the end of the archive", (long long) cursor);
+            status = -1;
+            break;
+        }
+        
+        char type = header[kTarType];
+        if (type == 'L' || type == 'x') {
+            if (size > MAX_EXTENDED_HEADER) {
+                snprintf(error, errorSize, "extended header at %lld is too large", (long long) cursor);
+                status = -1;
+                break;
+            }
+            char *data = malloc(size + 1);
+            if (!data || read_fully(fd, data, size, dataOffset) != 0) {
+                free(data);
+                snprintf(error, errorSize, "could not read extended header at %lld", (long long) cursor);
+                status = -1;
+                break;
+            }
+            data[size] = '\0';
+            
+            if (type == 'L') {
+                free(nextName);
+                nextName = data;
+            } else {
+                parse_pax_records(data, size, &nextName, &nextSize);
+                free(data);
+            }
+        } else if (type != 'K' && type != 'g') {
+            // Only the contiguous data of regular files can be patched in place
+            if (type == '0' || type == '\0' || type == '7') {
+                add_member(index, nextName ? nextName : header_name(header), dataOffset, size);
+            } else {
+                free(nextName);
+            }
+            nextName = NULL;
+            nextSize = -1;
+        }
+        
+        cursor = dataOffset + ((size + TAR_BLOCK_SIZE - 1) & ~(off_t)(TAR_BLOCK_SIZE - 1));
+    }
+    
+    free(nextName);
+    return status;
+}
+
+void tar_index_free (TarIndex *index)
+{
+    for (int i = 0; i < index->count; i++) {
+        free(index->members[i].name);
+    }
+    free(index->members);
+    memset(index, 0, sizeof(TarIndex));
+}
@@ -0,0 +1,47 @@
+//
+//  tar.h
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QTVRFIX_TAR_H
+#define QTVRFIX_TAR_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// A regular file stored in an uncompressed tar archive
+typedef struct _TarMember {
+    char *      name;
+    off_t       offset;     // first data byte in the archive
+    off_t       size;
+} TarMember;
+
+typedef struct _TarIndex {
+    TarMember * members;
+    int         count;
+    int         capacity;
+} TarIndex;
+
+// Walks the headers of the archive open on fd (ustar, GNU long names and pax 'path'
+// and 'size' records) and lists its regular files. Returns -1 and describes the
+// problem in error if a header is damaged; members before it are still listed.
+int tar_index_read (TarIndex *index, int fd, off_t archiveSize, char *error, size_t errorSize);
+void tar_index_free (TarIndex *index);
+
+#endif
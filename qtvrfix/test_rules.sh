@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+#  test_rules.sh
+#  qtvrfix
+#
+#  Checks that patch rules with fields or values that don't fit are refused, and that
+#  the ones that fit are applied. Usage: test_rules.sh path/to/qtvrfix
+#
+
+QTVRFIX=${1:-./qtvrfix}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/qtvrfix-rules.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT
+FAILED=0
+
+# A movie holding one 'vide' track whose 84-byte 'tkhd' is all zeros
+make_movie()
+{
+    {
+        printf '\000\000\000\225moov\000\000\000\215trak\000\000\000\134tkhd'
+        head -c 84 /dev/zero
+        printf '\000\000\000\051mdia\000\000\000\041hdlr\000\000\000\000\000\000\000\000vide'
+        head -c 13 /dev/zero
+    } > "$1"
+}
+
+# expect accept|reject RULE
+expect()
+{
+    printf '%s\n' "$2" > "$WORK/rules.txt"
+    if "$QTVRFIX" --rules "$WORK/rules.txt" > /dev/null 2>&1; then result=accept; else result=reject; fi
+    if [ "$result" != "$1" ]; then
+        echo "FAIL: expected $1: $2"
+        FAILED=1
+    fi
+}
+
+# expect_patch changed|unchanged RULE
+expect_patch()
+{
+    make_movie "$WORK/before.mov"
+    make_movie "$WORK/movie.mov"
+    printf '%s\n' "$2" > "$WORK/rules.txt"
+    if ! "$QTVRFIX" --rules "$WORK/rules.txt" "$WORK/movie.mov" > /dev/null 2>&1; then
+        echo "FAIL: $2 failed on the movie"
+        FAILED=1
+        return
+    fi
+    if cmp -s "$WORK/before.mov" "$WORK/movie.mov"; then result=unchanged; else result=changed; fi
+    if [ "$result" != "$1" ]; then
+        echo "FAIL: expected the movie $1: $2"
+        FAILED=1
+    fi
+}
+
+# Raw field offsets: offset plus width must fit in 32 bits, and inside 'pdat'
+expect reject 'vide tkhd set u32@4294967295=1'
+expect reject 'vide tkhd set u8@4294967295=1'
+expect reject 'vide tkhd set u8@4294967296=1'
+expect accept 'vide tkhd set u8@4294967294=1'
+expect reject 'pano sean/pdat set u32@84=1'
+expect reject 'pano sean/pdat set u32@81=1'
+expect accept 'pano sean/pdat set u32@80=1'
+expect reject 'pano sean/pdat if u8@84==0 set flags=1'
+expect reject 'vide tkhd set u8@-1=1'
+expect reject 'vide tkhd set u8@=1'
+expect reject 'vide tkhd set u8@1x=1'
+
+# Values must fit the field's width, and negative numbers aren't wrapped around
+expect accept 'vide tkhd set u8@0=255'
+expect reject 'vide tkhd set u8@0=256'
+expect accept 'vide tkhd set u16@0=0xffff'
+expect reject 'vide tkhd set u16@0=65536'
+expect accept 'vide tkhd set u32@0=4294967295'
+expect reject 'vide tkhd set u32@0=4294967296'
+expect reject 'vide tkhd set u32@0=18446744073709551616'
+expect reject 'vide tkhd set u8@0=-1'
+expect reject 'vide tkhd set u32@0=-1'
+expect reject 'vide tkhd set u32@0=+1'
+expect reject 'vide tkhd if u16@0==-1 set u8@0=1'
+expect reject 'vide tkhd set u16@0='"'"'abcd'"'"
+expect accept 'vide tkhd set u32@0='"'"'abcd'"'"
+expect accept 'vide tkhd set f32@0=-1.5'
+
+# Fields past the end of the atom are skipped when the rule runs
+expect_patch changed 'vide tkhd set u8@83=1'
+expect_patch unchanged 'vide tkhd set u8@84=1'
+expect_patch unchanged 'vide tkhd set u8@4294967294=1'
+expect_patch unchanged 'vide tkhd if u8@4294967294==0 set u8@0=1'
+
+[ $FAILED -eq 0 ] && echo "All rule tests passed"
+exit $FAILED
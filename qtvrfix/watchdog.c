@@ -0,0 +1,202 @@
+//
+//  watchdog.c
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "watchdog.h"
+
+// Longest time between checks
+static const double cMaxCheckInterval = 0.5;
+
+enum {
+    kWatchIdle = 0,
+    kWatchBusy,
+    kWatchCancelled,    // past the deadline, cancel flag set
+    kWatchAbandoned     // past twice the deadline, handed to expired()
+};
+
+// Guarded by the watchdog's lock, apart from cancel, which the worker polls
+typedef struct _WatchedWorker {
+    int             state;
+    volatile int    cancel;
+    unsigned        generation;             // counts the worker's jobs
+    unsigned        signalledGeneration;    // the last job sent SIGUSR1
+    double          startTime;
+    double          deadline;
+    pthread_t       thread;
+    void *          item;
+} WatchedWorker;
+
+struct _Watchdog {
+    WatchedWorker *     workers;
+    int                 workerCount;
+    WatchdogExpired     expired;
+    void *              context;
+    
+    pthread_t           thread;
+    pthread_mutex_t     lock;
+    pthread_cond_t      wake;
+    int                 stopping;
+};
+
+static double current_time(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Does nothing; delivery alone makes a blocked read or write return EINTR
+static void interrupt_handler(int signal)
+{
+}
+
+// Called with the lock held, so no worker can finish its job and start the next one
+// while it is being looked at, and a signal always reaches the job it was meant for
+static void check_workers(Watchdog *watchdog)
+{
+    double now = current_time();
+    
+    for (int i = 0; i < watchdog->workerCount; i++) {
+        WatchedWorker *worker = &watchdog->workers[i];
+        double elapsed = now - worker->startTime;
+        
+        if (worker->state == kWatchBusy && elapsed > worker->deadline) {
+            worker->state = kWatchCancelled;
+            worker->cancel = 1;
+            // Once per job; a read it interrupts stays failed, and the cancel flag covers the rest
+            if (worker->signalledGeneration != worker->generation) {
+                worker->signalledGeneration = worker->generation;
+                pthread_kill(worker->thread, SIGUSR1);
+            }
+        } else if (worker->state == kWatchCancelled && elapsed > 2 * worker->deadline) {
+            worker->state = kWatchAbandoned;
+            watchdog->expired(i, worker->item, watchdog->context);
+        }
+    }
+}
+
+static void *watchdog_thread(void *argument)
+{
+    Watchdog *watchdog = (Watchdog *) argument;
+    
+    pthread_mutex_lock(&watchdog->lock);
+    while (!watchdog->stopping) {
+        double wakeTime = current_time() + cMaxCheckInterval;
+        struct timespec deadline;
+        deadline.tv_sec = (time_t) wakeTime;
+        deadline.tv_nsec = (long)((wakeTime - deadline.tv_sec) * 1e9);
+        
+        int result = 0;
+        while (!watchdog->stopping && result != ETIMEDOUT) {
+            result = pthread_cond_timedwait(&watchdog->wake, &watchdog->lock, &deadline);
+        }
+        if (!watchdog->stopping) {
+            check_workers(watchdog);
+        }
+    }
+    pthread_mutex_unlock(&watchdog->lock);
+    return NULL;
+}
+
+Watchdog *watchdog_start (int workers, WatchdogExpired expired, void *context)
+{
+    // Without SA_RESTART, so the interrupted call fails instead of resuming
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = interrupt_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    
+    Watchdog *watchdog = calloc(1, sizeof(Watchdog));
+    watchdog->workers = calloc(workers, sizeof(WatchedWorker));
+    watchdog->workerCount = workers;
+    watchdog->expired = expired;
+    watchdog->context = context;
+    
+    pthread_mutex_init(&watchdog->lock, NULL);
+    pthread_cond_init(&watchdog->wake, NULL);
+    if (pthread_create(&watchdog->thread, NULL, watchdog_thread, watchdog) != 0) {
+        free(watchdog->workers);
+        free(watchdog);
+        return NULL;
+    }
+    return watchdog;
+}
+
+volatile const int *watchdog_begin (Watchdog *watchdog, int worker, void *item, double deadline)
+{
+    WatchedWorker *watched = &watchdog->workers[worker];
+    pthread_mutex_lock(&watchdog->lock);
+    watched->generation++;
+    watched->item = item;
+    watched->thread = pthread_self();
+    watched->startTime = current_time();
+    watched->deadline = deadline;
+    watched->cancel = 0;
+    watched->state = kWatchBusy;
+    pthread_mutex_unlock(&watchdog->lock);
+    return &watched->cancel;
+}
+
+int watchdog_end (Watchdog *watchdog, int worker)
+{
+    WatchedWorker *watched = &watchdog->workers[worker];
+    int result = 0;
+    pthread_mutex_lock(&watchdog->lock);
+    if (watched->state == kWatchAbandoned) {
+        result = -1;
+    } else {
+        watched->state = kWatchIdle;
+        watched->cancel = 0;
+    }
+    pthread_mutex_unlock(&watchdog->lock);
+    return result;
+}
+
+void watchdog_stop (Watchdog *watchdog)
+{
+    if (!watchdog) {
+        return;
+    }
+    
+    pthread_mutex_lock(&watchdog->lock);
+    watchdog->stopping = 1;
+    pthread_cond_signal(&watchdog->wake);
+    pthread_mutex_unlock(&watchdog->lock);
+    pthread_join(watchdog->thread, NULL);
+    
+    // Abandoned workers may still call watchdog_end(), so their records stay
+    for (int i = 0; i < watchdog->workerCount; i++) {
+        if (watchdog->workers[i].state == kWatchAbandoned) {
+            return;
+        }
+    }
+    pthread_mutex_destroy(&watchdog->lock);
+    pthread_cond_destroy(&watchdog->wake);
+    free(watchdog->workers);
+    free(watchdog);
+}
@@ -0,0 +1,41 @@
+//
+//  watchdog.h
+//  qtvrfix
+//
+//  Copyright 2011 EyeSee360. All rights reserved.
+//
+/*
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QTVRFIX_WATCHDOG_H
+#define QTVRFIX_WATCHDOG_H
+
+// Called on the watchdog thread when a worker hasn't returned within twice its deadline
+typedef void (*WatchdogExpired)(int worker, void *item, void *context);
+
+// Enforces per-file deadlines on worker threads. Once a file is past its deadline its
+// cancel flag is set and the worker is sent SIGUSR1 once, which interrupts blocking
+// reads and writes. A worker still busy after another deadline is abandoned: expired
+// is called and the worker's own call to watchdog_end() will report it.
+typedef struct _Watchdog Watchdog;
+
+Watchdog *watchdog_start (int workers, WatchdogExpired expired, void *context);
+// Starts the clock for item on the calling worker thread; returns its cancel flag
+volatile const int *watchdog_begin (Watchdog *watchdog, int worker, void *item, double deadline);
+// Returns -1 if the worker was abandoned meanwhile; it then owns nothing shared
+int watchdog_end (Watchdog *watchdog, int worker);
+void watchdog_stop (Watchdog *watchdog);
+
+#endif